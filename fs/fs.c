@@ -20,7 +20,7 @@ void *disk_addr(u_int blockno) {
 //  Check if this virtual address is mapped to a block. (check PTE_V bit)
 int va_is_mapped(void *va) {
 	// Must check pgdir and pgtbl(2nd level) at the same time!
-	return (vpd[PDX(va)] & PTE_V) && ((vpt[VPN(va)] & PTE_V) || (vpt[VPN(va)] & PTE_SWAPPED));
+	return (vpd[PDX(va)] & (PTE_V | PTE_SWAPPED)) && ((vpt[VPN(va)] & PTE_V) || (vpt[VPN(va)] & PTE_SWAPPED));
 }
 
 // Overview:
@@ -63,6 +63,20 @@ int dirty_block(u_int blockno) {
 	return syscall_mem_map(0, va, 0, va, PTE_D | PTE_DIRTY);
 }
 
+// Overview:
+//  Mark this block as a clean copy of the disk (not dirty). Under memory pressure, the kernel
+//  may then drop the cache page instead of swapping it out, after which the block is unmapped
+//  and read again when needed. So keep no pointers into it, as to regular file data.
+int clean_block(u_int blockno) {
+	void *va = disk_addr(blockno);
+
+	if (!va_is_mapped(va)) {
+		return -E_NOT_FOUND;
+	}
+
+	return syscall_mem_map(0, va, 0, va, PTE_D | PTE_REFETCH);
+}
+
 // Overview:
 //  Write the current contents of the block out to disk.
 void write_block(u_int blockno) {
@@ -480,6 +494,11 @@ int file_get_block(struct File *f, u_int filebno, void **blk) {
 	if ((r = read_block(diskbno, blk, &isnew)) < 0) {
 		return r;
 	}
+
+	// The data blocks of a regular file can be dropped and read again.
+	if (isnew && f->f_type == FTYPE_REG) {
+		return clean_block(diskbno);
+	}
 	return 0;
 }
 
@@ -766,6 +785,9 @@ void file_flush(struct File *f) {
 		}
 		if (block_is_dirty(diskno)) {
 			write_block(diskno);
+			if (f->f_type == FTYPE_REG) {
+				clean_block(diskno);
+			}
 		}
 	}
 }
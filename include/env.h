@@ -43,12 +43,34 @@ struct Env {
 
 	// Lab 6 scheduler counts
 	u_int env_runs; // number of times we've been env_run'ed
+
+	// Swap reverse mapping
+	struct AnonFamily *env_anon;	 // fork family of this env
+	LIST_ENTRY(Env) env_anon_link; // intrusive entry in 'env_anon->members'
+
+	// Resident set (see swap_out_env)
+	u_int env_rss;		      // registered mappings to resident pages
+	u_int env_rss_limit;	      // resident limit in pages, 0 for none
+	u_int env_rss_hard;	      // whether the limit is enforced on every fault
+	u_long env_rss_hand;	      // VA the scan for local victims resumes at
+	LIST_ENTRY(Env) env_rss_link; // intrusive entry in 'env_rss_list', if limited
+
+	// Load control (see kern/sched.c)
+	u_int env_majflt;		     // major faults in the current load control window
+	u_int env_inactive;		     // whether load control has deactivated this env
+	u_int env_inactive_since;	     // window it was deactivated in
+	TAILQ_ENTRY(Env) env_inactive_link; // intrusive entry in 'env_inactive_list', if inactive
+
+	// Swap-in wait
+	struct sd_req *env_swap_req;   // swap disk read this env is blocked on, NULL if none
+	LIST_ENTRY(Env) env_swap_link; // intrusive entry in 'env_swap_req->waiters'
 };
 
 LIST_HEAD(Env_list, Env);
 TAILQ_HEAD(Env_sched_list, Env);
 extern struct Env *curenv;		     // the current env
 extern struct Env_sched_list env_sched_list; // runnable env list
+extern struct Env_sched_list env_inactive_list; // envs deactivated by load control
 
 void env_init(void);
 int env_alloc(struct Env **e, u_int parent_id);
@@ -57,6 +79,7 @@ struct Env *env_create(const void *binary, size_t size, int priority);
 void env_destroy(struct Env *e);
 
 int envid2env(u_int envid, struct Env **penv, int checkperm);
+struct Env *asid2env(u_int asid);
 void env_run(struct Env *e) __attribute__((noreturn));
 
 void env_check(void);
@@ -5,4 +5,25 @@ void printcharc(char ch);
 int scancharc(void);
 void halt(void) __attribute__((noreturn));
 
+// CP0 Count, incrementing every other CPU cycle. Used for timing.
+static inline unsigned int read_cp0_count(void) {
+	unsigned int count;
+	asm volatile("mfc0 %0, $9" : "=r"(count) :);
+	return count;
+}
+
+// CP0 Cause, telling the code of the exception being handled.
+static inline unsigned int read_cp0_cause(void) {
+	unsigned int cause;
+	asm volatile("mfc0 %0, $13" : "=r"(cause) :);
+	return cause;
+}
+
+// CP0 EPC, the address the exception being handled was taken at.
+static inline unsigned int read_cp0_epc(void) {
+	unsigned int epc;
+	asm volatile("mfc0 %0, $14" : "=r"(epc) :);
+	return epc;
+}
+
 #endif
@@ -46,8 +46,21 @@
 #define MALTA_SWAP_STATUS (MALTA_SWAP_BASE + 0x07)
 #define MALTA_SWAP_LBA 0xE0
 #define MALTA_SWAP_BUSY 0x80
+#define MALTA_SWAP_DRQ 0x08   /* Data request, ready to transfer a sector */
+#define MALTA_SWAP_ERROR 0x01 /* Error bit in STATUS */
 #define MALTA_SWAP_CMD_PIO_READ 0x20  /* Read sectors with retry */
 #define MALTA_SWAP_CMD_PIO_WRITE 0x30 /* write sectors with retry */
+#define MALTA_SWAP_CMD_IDENTIFY 0xEC  /* IDENTIFY DEVICE */
+#define MALTA_SWAP_CTRL (MALTA_PCIIO_BASE + 0x0376) /* Device control, bit 1 masks INTRQ */
+#define MALTA_SWAP_IRQ 15			     /* i8259 line of the secondary channel */
+
+/*
+ * Intel 8259 interrupt controllers, cascaded on line 2 of the master, whose
+ * output is CPU interrupt 2 (STATUS_IM2).
+ */
+#define MALTA_I8259_MASTER (MALTA_PCIIO_BASE + 0x20)
+#define MALTA_I8259_SLAVE (MALTA_PCIIO_BASE + 0xa0)
+#define MALTA_I8259_EOI 0x20 /* non-specific end of interrupt, to the command port */
 
 /*
  * MALTA Power Management device definitions.
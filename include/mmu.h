@@ -11,6 +11,10 @@
 #define PDMAP (4 * 1024 * 1024) // bytes mapped by a page directory entry
 #define PGSHIFT 12
 #define PDSHIFT 22 // log2(PDMAP)
+#define PAGE_NORDER 11 // orders of free blocks of physical pages, up to 2^10 pages
+#define LPAGE_ORDER 4	  // large pages of 2^4 pages (64 KiB), see _do_tlb_refill
+#define LPAGE_ORDER_MAX 6 // and of 2^6 pages (256 KiB)
+#define PAGEMASK(order) (((1 << (order)) - 1) << (PGSHIFT + 1)) // CP0 PageMask of a page size
 #define PDX(va) ((((u_long)(va)) >> PDSHIFT) & 0x03FF)
 #define PTX(va) ((((u_long)(va)) >> PGSHIFT) & 0x03FF)
 #define PTE_ADDR(pte) (((u_long)(pte)) & ~0xFFF)
@@ -68,6 +72,14 @@
 // Swapped page. Reserved for software, used by swap.
 #define PTE_SWAPPED 0x0008
 
+// Reference bit sampling: the next TLB refill of this valid page traps into the kernel.
+// Reserved for software, used by swap.
+#define PTE_REFTRAP 0x0010
+
+// Cached data the env can fetch again, e.g. a disk block: while clean, the page is dropped
+// rather than swapped out. Reserved for software, used by swap.
+#define PTE_REFETCH 0x0020
+
 // Memory segments (32-bit kernel mode addresses)
 #define KUSEG 0x00000000U
 #define KSEG0 0x80000000U
@@ -21,12 +21,39 @@ struct Page { // physical page's management structure
 	// to this page.  This only holds for pages allocated using
 	// page_alloc.  Pages allocated at boot time using pmap.c's "alloc"
 	// do not have valid reference count fields.
-	u_short pp_ref;
+	u_int pp_ref;
 	u_short accessed;
+	u_short pp_flags; // PG_* flags below
+	u_short pp_order; // order of its block, if PG_BUDDY or PG_KMALLOC (first page), or PG_LARGE
+	u_int pp_age;	  // private to the page replacement policy
 };
 
+// Page flags
+#define PG_PINNED 0x0001	// Never pick as a swap victim.
+#define PG_READAHEAD 0x0002 // Swapped in by readahead, not used yet.
+#define PG_SWAPCACHE 0x0004 // Clean, with a copy in swap (see swap_cache_drop).
+#define PG_ZERO 0x0008	    // The shared zero page, copied on store (see zero_page_break).
+#define PG_PGTABLE 0x0010   // A swappable user page table (see pgtable_register).
+#define PG_CLEAN 0x0020	    // Not stored to since mapped PTE_REFETCH (see refetch_mark_clean).
+#define PG_BUDDY 0x0040	    // First page of a free block in 'page_free_area'.
+#define PG_KMALLOC 0x0080   // First page of a block allocated by 'kmalloc'.
+#define PG_LARGE 0x0100	    // In a block mapped as a large page (see large_alloc).
+
+// Free memory, in blocks of 2^order contiguous pages (see page_alloc_order), and single pages
+// zeroed ahead of time (see page_prezero).
+struct Page_free_area {
+	struct Page_list lists[PAGE_NORDER]; // free blocks, by order
+	u_int nfree[PAGE_NORDER];	     // number of free blocks, by order
+	struct Page_list zeroed;	     // free pages filled with zero already
+	u_int nzeroed;			     // number of them
+};
+
+// Free pages kept zeroed ahead of time, at most.
+#define PAGE_ZERO_TARGET (npage / 64)
+
 extern struct Page *pages; // address of the page array
-extern struct Page_list page_free_list; // head of the free list of physical pages
+extern struct Page_free_area page_free_area; // free physical pages
+extern u_int page_nfree;		     // number of free pages
 
 static inline u_long page2ppn(struct Page *pp) {
 	return pp - pages;
@@ -67,8 +94,14 @@ void mips_init(u_int argc, char **argv, char **penv, u_int ram_low_size);
 void page_init(void);
 void *alloc(u_int n, u_int align, int clear);
 
-int page_alloc(struct Page **pp); // allocate the 1st of free list
+int page_alloc(struct Page **pp); // allocate a free page
+int page_alloc_order(u_int order, struct Page **pp); // allocate 2^order contiguous pages
+int page_alloc_nozero(struct Page **pp); // allocate a free page to be overwritten whole
+u_int page_prezero(u_int n);
 void page_free(struct Page *pp);
+void page_free_order(struct Page *pp, u_int order);
+void page_free_steal(struct Page_free_area *save);
+void page_free_restore(struct Page_free_area *save);
 void page_decref(struct Page *pp);
 
 /* page_insert:
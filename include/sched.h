@@ -1,6 +1,12 @@
 #ifndef __SCHED_H__
 #define __SCHED_H__
 
+#define LOADCTL_WINDOW 8   /* timer ticks per load control decision */
+#define LOADCTL_THRASH 64  /* major faults per window above which memory is overcommitted */
+#define LOADCTL_CALM 16	   /* and below which a deactivated env is let back in */
+#define LOADCTL_MAX_OUT 16 /* max windows an env stays deactivated while others thrash */
+
 void schedule(int yield) __attribute__((noreturn));
+void loadctl_tick(void);
 
 #endif /* __SCHED_H__ */
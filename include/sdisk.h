@@ -1,25 +1,91 @@
 #ifndef _SDISK_H_
 #define _SDISK_H_
 
+#include <env.h>
 #include <pmap.h>
 #include <types.h>
 
 #define SECT_SIZE 512
-#define SD_NBLK 2048 /* 32M */
-#define SD_MAX (SD_NBLK * BLOCK_SIZE)
+#define SD_MAX_NSECT 256 /* sectors a single command can transfer (NSECT = 0) */
 // Restriction: PA in PTE is 20 bits, max 0xFFFFF.
+// Swap tables take about 28 bytes per block, so use at most 4 blocks per page of memory.
+#define SD_MAX_NBLK MIN(4 * npage, 1u << 20)
 #define SECT2BLK (BLOCK_SIZE / SECT_SIZE)
 /* sectors to a block */
 #define BLOCK_SIZE PAGE_SIZE
 
+// Swap devices: the master and slave drives on the secondary IDE channel.
+#define SD_NDEV 2
+#ifdef MOS_SWAP_PRIO_MASTER
+#define SD_PRIO_MASTER MOS_SWAP_PRIO_MASTER
+#else
+#define SD_PRIO_MASTER 0 /* higher priorities are used first, equal ones striped */
+#endif
+#ifdef MOS_SWAP_PRIO_SLAVE
+#define SD_PRIO_SLAVE MOS_SWAP_PRIO_SLAVE
+#else
+#define SD_PRIO_SLAVE 0
+#endif
+
+struct sd_dev {
+	u_int drive;  // 0 for the master, 1 for the slave
+	int prio;     // priority
+	u_int start;  // first block number
+	u_int nblk;   // number of blocks, 0 if absent
+	u_int nfree;  // number of free blocks
+	u_int cursor; // word of the slot bitmap to start searching from
+};
+extern struct sd_dev sd_devs[SD_NDEV];
+extern u_int sd_nblk;  // block numbers spanned by the devices, gaps between them included
+extern u_int sd_total; // blocks on the devices
+void sd_probe(void);
+
 // Swap disk bitmap control.
+extern u_int sd_nfree;
 int sd_block_alloc();
-void sd_block_free();
+u_int sd_block_alloc_run(u_int n, u_int *pbno);
+void sd_block_free(u_int bno);
+int sd_block_used(u_int bno);
 void sd_bitmap_init();
+void test_sd_alloc(void); // allocator self-test
 
 // Swap disk access control.
 void test_sdisk(void); // simple test
 void read_page(struct Page *pp, u_int bno);
 void write_page(struct Page *pp, u_int bno);
+// Clustered access: `n` pages to/from the contiguous blocks [bno, bno + n).
+void read_pages(struct Page **pps, u_int bno, u_int n);
+void write_pages(struct Page **pps, u_int bno, u_int n);
+void bench_sdisk(u_int nblk); // driver microbenchmark
+
+/*
+ * Interrupt-driven reads.
+ *
+ * A read is queued as requests of at most one command each, and moved a sector
+ * per swap disk interrupt while envs run. The synchronous calls above first let
+ * the read in flight finish, and hold the queue until they are done.
+ */
+#define SD_NREQ 64 /* requests in flight at most */
+
+struct sd_req {
+	TAILQ_ENTRY(sd_req) link;		    // entry in the queue, the done or the free list
+	struct Page *pps[SD_MAX_NSECT / SECT2BLK]; // pages read into
+	u_int bno;				    // first block
+	u_int n;				    // number of blocks
+	u_int nsect;				    // sectors read so far
+	int done;				    // whether all are read
+	int fault;		 // index of the page faulted on in 'pps', -1 if none
+	struct Env_list waiters; // envs blocked until the request is done
+};
+TAILQ_HEAD(sd_req_tailq, sd_req);
+
+void sd_intr_init(void);
+void sd_intr(void);
+struct sd_req *sd_read_async(struct Page **pps, u_int bno, u_int n);
+struct sd_req *sd_req_find(u_int bno);
+void sd_wait(struct sd_req *r);
+int sd_wait_any(void);
+struct sd_req *sd_reap(void);
+void sd_req_free(struct sd_req *r);
 
 #endif
@@ -0,0 +1,64 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <pmap.h>
+#include <queue.h>
+#include <types.h>
+
+/*
+ * Kernel object caches.
+ *
+ * A 'kmem_cache' hands out fixed-size objects carved out of slabs, each slab
+ * being one page taken from 'page_alloc' on demand. The 'Slab' header sits at
+ * the start of its page, so the slab of an object is found by rounding the
+ * object address down to the page.
+ *
+ * 'kmalloc' serves requests of any size from a cache per power-of-two size
+ * class, from KMALLOC_MIN to KMALLOC_MAX bytes. Larger requests take blocks of
+ * whole pages from 'page_alloc_order', flagged PG_KMALLOC.
+ */
+#define KMALLOC_MIN 16
+#define KMALLOC_MAX 1024
+#define KMALLOC_NCLASS 7 /* size classes from KMALLOC_MIN to KMALLOC_MAX */
+
+struct kmem_cache;
+
+struct Slab {
+	LIST_ENTRY(Slab) slab_link; // intrusive entry in one of the cache's slab lists
+	struct kmem_cache *cache;   // the cache this slab belongs to
+	void *free;		    // free objects, chained through their first word
+	u_int inuse;		    // number of objects handed out
+};
+LIST_HEAD(Slab_list, Slab);
+
+struct kmem_cache {
+	const char *name;
+	u_int objsize;
+	u_int objs_per_slab;
+
+	struct Slab_list partial; // slabs with both free and used objects
+	struct Slab_list full;	  // slabs with no free object
+	struct Slab_list empty;	  // slabs with no used object, released on memory pressure
+
+	u_int nslabs;  // number of pages held by this cache
+	u_int nobjs;   // number of objects handed out
+	u_int nallocs; // objects allocated since boot
+	u_int nfrees;  // objects freed since boot
+	u_int nfails;  // allocations failed for memory
+
+	LIST_ENTRY(kmem_cache) cache_link; // intrusive entry in the list of all caches
+};
+
+void kmem_cache_init(struct kmem_cache *cache, const char *name, u_int objsize);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+int kmem_cache_reap(void);
+u_int kmem_pages(void);
+void kmem_print_stats(void);
+
+void kmalloc_init(void);
+void *kmalloc(u_int size);
+void kfree(void *obj);
+void test_kmalloc(void); // size class and page block self-test
+
+#endif /* _SLAB_H_ */
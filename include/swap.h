@@ -1,15 +1,48 @@
 #ifndef _SWAP_H_
 #define _SWAP_H_
 
+#include <env.h>
 #include <pmap.h>
 #include <sdisk.h>
+#include <vmstat.h>
 
-#define NSWAP 100 /* swap operation times */
-#define MAX_SWAPINFO 0x15000
+#ifdef MOS_NSWAP
+#define NSWAP MOS_NSWAP /* pages to swap out on each reclaim */
+#else
+#define NSWAP 100 /* pages to swap out on each reclaim */
+#endif
+#define SWAP_CLUSTER (SD_MAX_NSECT / SECT2BLK) /* max pages written by one command */
+#define SWAP_WMARK_LOW (npage / 64)  /* the page-out daemon wakes below this many free pages */
+#define SWAP_WMARK_HIGH (npage / 32) /* and sleeps again once this many are free */
+#define SWAPD_BATCH (2 * SWAP_CLUSTER) /* max pages the daemon swaps out per timer tick */
+#define SWAP_RA_INIT 4	   /* initial swap-in readahead window, in pages */
+#define SWAP_RA_MAX 32	   /* max pages read ahead on a swap-in */
+#define SWAP_RA_RESERVE 64 /* free pages readahead never takes */
 
 extern struct Page_tailq page_swap_queue;
+extern struct vmstat vmstat;
+
+// Page replacement policy, see kern/swap_policy.c.
+struct swap_policy {
+	const char *name;
+	void (*init)(void);
+	void (*insert)(struct Page *pp); // 'pp' becomes swappable.
+	void (*access)(struct Page *pp); // 'pp' is referenced.
+	void (*remove)(struct Page *pp); // 'pp' is no longer swappable.
+	struct Page *(*pick)(void);	 // Take a victim off the policy, NULL if there is none.
+};
+extern const struct swap_policy *const swap_policy;
+
+// A fork family: an env created by env_create() and all envs forked from it.
+// Pages shared in a family are usually mapped at the same VA in its members,
+// so one (family, va) anchor in the swap table covers all of those mappings.
+struct AnonFamily {
+	struct Env_list members; // Alive envs of the family, linked by 'env_anon_link'.
+	u_int refs;		 // Members plus swap table entries anchored here.
+};
 
 typedef LIST_ENTRY(SwapInfo) SwapInfoLink;
+// A mapping not covered by the anchor of its page (other VA or other family).
 struct SwapInfo {
 	SwapInfoLink link;
 	Pde *pgdir;
@@ -17,10 +50,24 @@ struct SwapInfo {
 	u_int va; // The VA that triggers page allocation
 			  // when this page is first allocated.
 			  // Enough for finding PTE and flush TLB.
+	struct AnonFamily *anon; // Family of the mapping env, NULL if unknown.
 };
-typedef LIST_HEAD(SwapTableEntry_t, SwapInfo) SwapTableEntry;
+LIST_HEAD(SwapInfo_list, SwapInfo);
+
+// Reverse map of a PPage (or of a swapped page in bno_tbl).
+// The 'mapcount' mappings at 'va' in members of 'anon' are found by walking the
+// family; all other mappings are recorded one by one in 'sinfos'.
+typedef struct SwapTableEntry {
+	struct AnonFamily *anon;     // Anchor family, NULL if 'mapcount' is 0.
+	u_int va;		     // Anchor VA.
+	u_int mapcount;		     // Number of mappings covered by the anchor.
+	struct SwapInfo_list sinfos; // Mappings outside the anchor.
+	u_int pp_age;		     // 'pp_age' of the page while it is swapped out.
+	u_int cache_bno;	     // Swap block with a copy of the page, if PG_SWAPCACHE.
+	TAILQ_ENTRY(SwapTableEntry) cache_link; // In the swap cache, if PG_SWAPCACHE.
+} SwapTableEntry;
 extern SwapTableEntry *swap_tbl;
-extern SwapTableEntry *bno_tbl;//[SD_NBLK];
+extern SwapTableEntry *bno_tbl;//[sd_nblk];
 
 static inline SwapTableEntry *page2ste(struct Page *pp) {
 	return swap_tbl + (pp - pages);
@@ -31,10 +78,38 @@ static inline SwapTableEntry *bno2ste(u_int sd_bno) {
 	return bno_tbl + sd_bno;
 }
 
+// Whether any registered (swappable) mapping is recorded in 'ste'.
+static inline int ste_mapped(SwapTableEntry *ste) {
+	return ste->mapcount != 0 || !LIST_EMPTY(&ste->sinfos);
+}
+
+int anon_family_join(struct Env *e, struct Env *parent);
+void anon_family_leave(struct Env *e);
 void swap_init(void);
 void swap_register(struct Page *pp, Pde *pgdir, u_int va, u_int asid);
 void swap_unregister(struct Page *pp, Pde *pgdir, u_int va, u_int asid);
-void swap(void);
-void swap_back(Pte cur_pte);
+void swapd_tick(void);
+int swap_out(int n);
+void _print_sinfo(struct SwapInfo *sinfo);
+void swap_back(Pde *pgdir, u_long va, Pte cur_pte);
+u_int swap_pageref(Pde *pgdir, u_long va);
+int swap_share(Pde *srcpgdir, u_long srcva, Pde *pgdir, u_int asid, u_long va, u_int perm);
+extern int swap_in_may_block;
+void swap_io_complete(void);
+int swap_io_wait(void);
+void swap_intr(void);
+void swap_ra_hit(struct Page *pp);
+void swap_clear_ref(struct Page *pp);
+void swap_cache_drop(struct Page *pp);
+void refetch_mark_clean(struct Page *pp);
+void pgtable_register(Pde *pgdir, u_int asid, u_long va);
+
+// Resident set limits
+extern struct Env_list env_rss_list; // envs with a resident limit
+void swap_rss_check(struct Env *e, u_long va);
+void pgtable_swap_in(Pde *pgdir, u_long va);
+
+extern struct Page *zero_page;
+int zero_page_break(Pde *pgdir, u_int asid, u_long va);
 
 #endif
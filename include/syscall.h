@@ -22,6 +22,9 @@ enum {
 	SYS_cgetc,
 	SYS_write_dev,
 	SYS_read_dev,
+	SYS_vmstat,
+	SYS_set_rss_limit,
+	SYS_pageref,
 	MAX_SYSNO,
 };
 
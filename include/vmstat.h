@@ -0,0 +1,68 @@
+#ifndef _VMSTAT_H_
+#define _VMSTAT_H_
+
+#include <mmu.h>
+#include <types.h>
+
+/*
+ * Virtual memory statistics, read with 'syscall_vmstat'.
+ *
+ * Event counts and cycle totals are kept since boot and wrap around; take the
+ * difference of two samples. Cycles are CP0 Count cycles, and a path running
+ * inside another (e.g. a direct reclaim in a TLB refill) counts in both.
+ */
+struct vmstat {
+	u_int ticks; // timer interrupts
+
+	// Events.
+	u_int swapouts;	       // pages swapped out (written, pooled or already clean in swap)
+	u_int swapins;	       // pages swapped in, read ahead or not
+	u_int readaheads;      // pages read ahead
+	u_int zero_dedups;     // all-zero victims remapped to the zero page
+	u_int direct_reclaims; // times page_alloc found no free page and reclaimed itself
+	u_int scanned;	       // pages looked at by the replacement policy for a victim
+	u_int tlb_refills;     // TLB refills, and TLB invalid faults
+	u_int passive_allocs;  // pages allocated on first touch
+	u_int zero_maps;       // first reads mapped to the zero page
+	u_int swapin_waits;    // faults that blocked their env until a swap-in read was done
+	u_int pt_swapouts;     // page tables swapped out
+	u_int pt_swapins;      // page tables swapped in
+	u_int rss_evictions;   // pages swapped out for envs over their resident limit or deactivated
+	u_int majflts;	       // faults that had to swap their page in
+	u_int refetch_drops;   // clean refetchable pages dropped instead of swapped out
+	u_int swap_shares;     // swapped-out pages mapped again (e.g. by fork) without a swap-in
+	u_int deactivations;   // envs deactivated by load control for thrashing
+	u_int reactivations;   // and let back in
+	u_int prezeroed;       // free pages zeroed ahead of time, while polling the swap disk
+	u_int prezero_hits;    // allocations served by a zeroed page, needing no clearing
+	u_int large_allocs;    // blocks of contiguous pages allocated for large pages
+	u_int large_refills;   // TLB refills writing a large-page entry
+
+	// Cycles.
+	u_int cyc_swapout;
+	u_int cyc_swapin;
+	u_int cyc_reclaim;
+	u_int cyc_refill;
+	u_int cyc_passive;
+
+	// Compressed swap pool.
+	u_int zswap_stores;  // pages compressed into the pool
+	u_int zswap_rejects; // pages written to disk for compressing poorly
+	u_int zswap_full;    // pages written to disk for the pool being full
+	u_int zswap_hits;    // swap-ins served by the pool
+	u_int zswap_misses;  // swap-ins read from disk
+	u_int zswap_objs;    // pages in the pool now
+	u_int zswap_bytes;   // their compressed size
+	u_int zswap_pages;   // pages held by the pool
+
+	// Current state.
+	u_int free_pages;
+	u_int free_blocks[PAGE_NORDER]; // free blocks of 2^i contiguous pages
+	u_int zeroed_pages;		// free pages zeroed ahead of time
+	u_int kmem_pages;		// pages held by kernel object caches and kmalloc
+	u_int total_pages;
+	u_int swap_used; // swap blocks
+	u_int swap_total;
+};
+
+#endif /* _VMSTAT_H_ */
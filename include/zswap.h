@@ -0,0 +1,37 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+#include <pmap.h>
+#include <types.h>
+
+/*
+ * Compressed swap pool.
+ *
+ * Evicted pages are compressed into a pool of kernel pages, and only go to the
+ * swap disk when the pool is full or they don't compress well. A pooled page
+ * still owns its swap block, which names it in the swapped PTEs, but the block
+ * is never written: the pool entry lives until the block is freed.
+ */
+#define ZSWAP_MAX_POOL (npage / 8)	      /* max pages held by the pool */
+#define ZSWAP_MAX_LEN (PAGE_SIZE * 3 / 4) /* larger compressed pages go to the disk */
+
+struct zswap_stats {
+	u_int stores;	// pages compressed into the pool
+	u_int rejects;	// pages sent to the disk for compressing poorly
+	u_int full;	// pages sent to the disk for the pool being full
+	u_int hits;	// swap-ins served from the pool
+	u_int misses;	// swap-ins read from the disk
+	u_int nobjs;	// pages currently in the pool
+	u_int nbytes;	// their compressed size
+	u_int npages;	// pages held by the pool
+};
+extern struct zswap_stats zswap_stats;
+
+void zswap_init(void);
+int zswap_store(struct Page *pp, u_int bno);
+int zswap_load(struct Page *pp, u_int bno);
+void zswap_invalidate(u_int bno);
+void zswap_print_stats(void);
+void test_zswap(void); // codec and pool self-test
+
+#endif /* _ZSWAP_H_ */
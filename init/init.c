@@ -3,6 +3,8 @@
 #include <pmap.h>
 #include <swap.h>
 #include <sdisk.h>
+#include <slab.h>
+#include <zswap.h>
 #include <printk.h>
 #include <sched.h>
 #include <trap.h>
@@ -49,6 +51,7 @@ void mips_init(u_int argc, char **argv, char **penv, u_int ram_low_size) {
 	page_init();
 	// Call swap disk tester.
 	//test_sdisk();
+	//bench_sdisk(2048);
 
 	// lab3:
 	env_init();
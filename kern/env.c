@@ -5,6 +5,7 @@
 #include <pmap.h>
 #include <printk.h>
 #include <sched.h>
+#include <swap.h>
 
 struct Env envs[NENV] __attribute__((aligned(PAGE_SIZE))); // All environments
 
@@ -13,6 +14,7 @@ struct Env *curenv = NULL;	      // the currently running env
 static struct Env_list env_free_list; // Free list
 // Invariant: 'env' in 'env_sched_list' iff. 'env->env_status' is 'RUNNABLE'.
 struct Env_sched_list env_sched_list; // Runnable list
+struct Env_sched_list env_inactive_list; // Deactivated by load control, oldest first
 
 // Base page directory: a base/template for user pgdir.
 // Whenever a user pgdir is created, it get a copy of base
@@ -20,6 +22,7 @@ struct Env_sched_list env_sched_list; // Runnable list
 static Pde *base_pgdir;
 
 static uint32_t asid_bitmap[NASID / 32] = {0};
+static struct Env *asid_envs[NASID]; // Owner of each allocated ASID.
 
 /* Overview:
  *  Allocate an unused ASID.
@@ -163,6 +166,7 @@ void env_init(void) {
 	 * 'TAILQ_INIT'. */
 	LIST_INIT(&env_free_list);
 	TAILQ_INIT(&env_sched_list);
+	TAILQ_INIT(&env_inactive_list);
 
 	/* Step 2: Traverse the elements of 'envs' array, set their status to 'ENV_FREE' and insert
 	 * them into the 'env_free_list'. Make sure, after the insertion, the order of envs in the
@@ -281,15 +285,30 @@ int env_alloc(struct Env **new, u_int parent_id) {
 	e->env_id = mkenvid(e);
 	try(asid_alloc(&(e->env_asid)));
 	e->env_parent_id = parent_id;
+	// A forked env joins the fork family of its parent, others start a new one.
+	struct Env *parent = NULL;
+	if (parent_id != 0 && envid2env(parent_id, &parent, 0) != 0) {
+		parent = NULL;
+	}
+	try(anon_family_join(e, parent));
+	asid_envs[e->env_asid] = e;
 	e->env_user_tlb_mod_entry = 0; // for lab4
 	e->env_runs = 0;	       // for lab6
+	e->env_swap_req = NULL;
+	e->env_rss = 0;
+	e->env_rss_limit = 0;
+	e->env_rss_hard = 0;
+	e->env_rss_hand = UTEMP;
+	e->env_majflt = 0;
+	e->env_inactive = 0;
 
 	/* Step 4: Initialize the user stack pointer and 'cp0_status' in 'e->env_tf'.
 	 *   Set the EXL bit to ensure that the processor remains in kernel mode during context
 	 * recovery. Additionally, set UM to 1 so that when ERET unsets EXL, the processor
 	 * transitions to user mode.
 	 */
-	e->env_tf.cp0_status = STATUS_IM7 | STATUS_IE | STATUS_EXL | STATUS_UM;
+	// IM2 lets the swap disk interrupt in, see sd_intr.
+	e->env_tf.cp0_status = STATUS_IM7 | STATUS_IM2 | STATUS_IE | STATUS_EXL | STATUS_UM;
 	// Set up the user stack pointer here.
 	// Reserve space for 'argc' and 'argv'.
 	e->env_tf.regs[29] = USTACKTOP - sizeof(int) - sizeof(char **);
@@ -301,6 +320,16 @@ int env_alloc(struct Env **new, u_int parent_id) {
 	return 0;
 }
 
+/* Overview:
+ *   Find the env owning 'asid'.
+ *
+ * Post-Condition:
+ *   return the env, or NULL if 'asid' is not allocated to any env.
+ */
+struct Env *asid2env(u_int asid) {
+	return asid_envs[asid & (NASID - 1)];
+}
+
 /* Overview:
  *   Load a page into the user address space of an env with permission 'perm'.
  *   If 'src' is not NULL, copy the 'len' bytes from 'src' into 'offset' at this page.
@@ -412,16 +441,29 @@ void env_free(struct Env *e) {
 	/* Hint: Note the environment's demise.*/
 	printk("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// Stop waiting for a swap-in: the pages are mapped back when the read is done, and
+	// unmapped below. Put it back on 'env_sched_list' to be taken off with the others.
+	if (e->env_swap_req != NULL) {
+		LIST_REMOVE(e, env_swap_link);
+		e->env_swap_req = NULL;
+		TAILQ_INSERT_TAIL(&env_sched_list, e, env_sched_link);
+	}
+
 	/* Hint: Flush all mapped pages in the user portion of the address space */
 	// Note: UVPT not included!!!
 	for (pdeno = 0; pdeno < PDX(UTOP/*UTOP*/); pdeno++) {
 		/* Hint: only look at mapped page tables. */
-		// Page tables won't be swapped out.
+		// A swapped-out page table still maps swapped pages: bring it back to unmap them,
+		// and keep it from being swapped out again meanwhile.
+		if (e->env_pgdir[pdeno] & PTE_SWAPPED) {
+			pgtable_swap_in(e->env_pgdir, pdeno << PDSHIFT);
+		}
 		if (!(e->env_pgdir[pdeno] & PTE_V)) { continue; }
 
 		/* Hint: find the pa and va of the page table. */
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (Pte *)KADDR(pa);
+		pa2page(pa)->pp_flags |= PG_PINNED;
 		/* Hint: Unmap all PTEs in this page table. */
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
 			if ((pt[pteno] & PTE_V) || (pt[pteno] & PTE_SWAPPED)) {
@@ -431,6 +473,7 @@ void env_free(struct Env *e) {
 		}
 
 		/* Hint: free the page table itself. */
+		swap_unregister(pa2page(pa), e->env_pgdir, UVPT + (pdeno << PGSHIFT), e->env_asid);
 		e->env_pgdir[pdeno] = 0;
 		page_decref(pa2page(pa));
 		/* Hint: invalidate page table in TLB */
@@ -440,7 +483,15 @@ void env_free(struct Env *e) {
 	/* Hint: free the page directory. */
 	page_decref(pa2page(PADDR(e->env_pgdir)));
 	/* Hint: free the ASID */
+	if (e->env_rss_limit != 0) {
+		LIST_REMOVE(e, env_rss_link);
+	}
+	if (e->env_inactive) {
+		TAILQ_REMOVE(&env_inactive_list, e, env_inactive_link);
+	}
+	asid_envs[e->env_asid] = NULL;
 	asid_free(e->env_asid);
+	anon_family_leave(e);
 	/* Hint: invalidate page directory in TLB */
 	tlb_invalidate(e->env_asid, UVPT + (PDX(UVPT) << PGSHIFT));
 	/* Hint: return the environment to the free list. */
@@ -3,7 +3,7 @@ lab-ge = $(shell [ "$$(echo $(lab)_ | cut -f1 -d_)" -ge $(1) ] && echo true)
 targets             := machine.o printk.o panic.o
 
 ifeq ($(call lab-ge,2), true)
-	targets     += pmap.o tlb_asm.o tlbex.o
+	targets     += pmap.o tlb_asm.o tlbex.o slab.o swap_policy.o zswap.o
 endif
 
 ifeq ($(call lab-ge,3), true)
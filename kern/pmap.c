@@ -7,6 +7,10 @@
 #include <types.h>
 #include <sdisk.h>
 #include <printk.h>
+#include <io.h>
+#include <sched.h>
+#include <slab.h>
+#include <zswap.h>
 
 /* These variables are set by mips_detect_memory(ram_low_size); */
 static u_long memsize; /* Maximum physical address */
@@ -17,7 +21,9 @@ Pde *cur_pgdir;
 struct Page *pages;
 static u_long freemem;
 
-struct Page_list page_free_list; /* Free list of physical pages */
+struct Page_free_area page_free_area; /* Free blocks of physical pages, by order */
+u_int page_nfree;		      /* Number of free pages */
+static int page_free_stolen;	      /* Free memory taken away by 'page_free_steal' */
 
 /* Overview:
  *   Use '_memsize' from bootloader to initialize 'memsize' and
@@ -88,18 +94,130 @@ void mips_vm_init() {
 	printk("pmap.c:\t mips vm init success\n");
 }
 
+/* Buddy allocator
+ *
+ * Free memory is kept in blocks of 2^order physically contiguous pages, aligned
+ * to their size, one free list per order in 'page_free_area'. The first page of
+ * a free block is flagged PG_BUDDY and holds its order. An allocation splits
+ * the smallest block large enough, giving back the upper halves; a free merges
+ * the block with its buddy (the other half of the block of the next order) for
+ * as long as the buddy is free as a whole too.
+ */
+
+static void buddy_insert(struct Page *pp, u_int order) {
+	pp->pp_flags |= PG_BUDDY;
+	pp->pp_order = order;
+	LIST_INSERT_HEAD(&page_free_area.lists[order], pp, pp_link);
+	page_free_area.nfree[order]++;
+}
+
+static void buddy_remove(struct Page *pp, u_int order) {
+	pp->pp_flags &= ~PG_BUDDY;
+	LIST_REMOVE(pp, pp_link);
+	page_free_area.nfree[order]--;
+}
+
+// Take a free block of 2^`order` pages, or return NULL if there is none.
+static struct Page *buddy_take(u_int order) {
+	u_int o = order;
+	while (o < PAGE_NORDER && LIST_EMPTY(&page_free_area.lists[o])) {
+		o++;
+	}
+	if (o == PAGE_NORDER) { return NULL; }
+
+	struct Page *pp = LIST_FIRST(&page_free_area.lists[o]);
+	buddy_remove(pp, o);
+	while (o > order) { // Split it, giving back the upper halves.
+		o--;
+		buddy_insert(pp + (1 << o), o);
+	}
+	page_nfree -= 1 << order;
+	return pp;
+}
+
+/* Pre-zeroed pages
+ *
+ * While the CPU would otherwise idle, polling for the swap disk, 'page_prezero'
+ * takes free pages from the buddy allocator, whose pages are dirty, fills them
+ * with zero and keeps them on 'page_free_area.zeroed', up to PAGE_ZERO_TARGET.
+ * 'page_alloc' takes a zeroed page first and needn't clear it then, while
+ * 'page_alloc_nozero', for pages about to be overwritten whole, leaves them to
+ * it. Zeroed pages count as free, but are not merged: they go back to the
+ * buddy allocator when a larger block is missing.
+ */
+
+static struct Page *zeroed_take(void) {
+	struct Page *pp = LIST_FIRST(&page_free_area.zeroed);
+	if (pp != NULL) {
+		LIST_REMOVE(pp, pp_link);
+		page_free_area.nzeroed--;
+		page_nfree--;
+	}
+	return pp;
+}
+
+// Give the zeroed pages back to the buddy allocator, to be merged.
+static void zeroed_flush(void) {
+	struct Page *pp;
+	while ((pp = zeroed_take()) != NULL) {
+		page_free(pp);
+	}
+}
+
+// Zero at most `n` free pages ahead of time, and return how many were.
+u_int page_prezero(u_int n) {
+	u_int i;
+	for (i = 0; i < n && page_free_area.nzeroed < PAGE_ZERO_TARGET && !page_free_stolen; i++) {
+		struct Page *pp = buddy_take(0);
+		if (pp == NULL) { break; }
+		memset((void *)page2kva(pp), 0, PAGE_SIZE);
+		LIST_INSERT_HEAD(&page_free_area.zeroed, pp, pp_link);
+		page_free_area.nzeroed++;
+		page_nfree++;
+	}
+	vmstat.prezeroed += i;
+	return i;
+}
+
+// Take a free block of 2^`order` pages, or return NULL. A single page comes from the zeroed
+// ones first if `zero`, and from the buddy allocator first otherwise. Set '*zeroed' if the
+// block is filled with zero already.
+static struct Page *page_take(u_int order, int zero, int *zeroed) {
+	struct Page *pp;
+
+	*zeroed = 0;
+	if (order == 0 && zero && (pp = zeroed_take()) != NULL) {
+		*zeroed = 1;
+		return pp;
+	}
+	if ((pp = buddy_take(order)) != NULL) { return pp; }
+	if (order == 0) {
+		*zeroed = (pp = zeroed_take()) != NULL;
+		return pp;
+	}
+	// The block may be missing for the zeroed pages only.
+	if (page_free_area.nzeroed == 0) { return NULL; }
+	zeroed_flush();
+	return buddy_take(order);
+}
+
 /* Overview:
  *   Initialize page structure and memory free list. The 'pages' array has one 'struct Page' entry
- * per physical page. Pages are reference counted, and free pages are kept on a linked list.
+ * per physical page. Pages are reference counted, and free pages are kept in 'page_free_area'.
  *
- * Hint: Use 'LIST_INSERT_HEAD' to insert free pages to 'page_free_list'.
+ * Hint: Use 'page_free' to give the free pages to the buddy allocator, which merges them.
  */
 void page_init(void) {
+	kmalloc_init();
 	swap_init();
-	/* Step 1: Initialize page_free_list. */
-	/* Hint: Use macro `LIST_INIT` defined in include/queue.h. */
-	/* Exercise 2.3: Your code here. (1/4) */
-	LIST_INIT(&page_free_list);
+	/* Step 1: Initialize page_free_area. */
+	for (u_int o = 0; o < PAGE_NORDER; o++) {
+		LIST_INIT(&page_free_area.lists[o]);
+		page_free_area.nfree[o] = 0;
+	}
+	LIST_INIT(&page_free_area.zeroed);
+	page_free_area.nzeroed = 0;
+	page_nfree = 0;
 
 	/* Step 2: Align `freemem` up to multiple of PAGE_SIZE. */
 	/* Exercise 2.3: Your code here. (2/4) */
@@ -117,8 +235,67 @@ void page_init(void) {
 	for (u_long pa = PADDR(freemem); pa < memsize; pa += PAGE_SIZE)
 	{
 		pa2page(pa)->pp_ref = 0;
-		LIST_INSERT_HEAD(&page_free_list, pa2page(pa), pp_link);
+		page_free(pa2page(pa));
+	}
+}
+
+// Allocate 2^`order` pages, see 'page_alloc_order'. Fill them with zero only if `zero`.
+static int page_alloc_block(u_int order, int zero, struct Page **new) {
+	int zeroed;
+
+	/* Step 1: Get a block from free memory. If fails, return the error code.*/
+	struct Page *pp = page_take(order, zero, &zeroed);
+	if (pp == NULL && !page_free_stolen)
+	{
+		// The page-out daemon (swapd_tick) couldn't keep up: reclaim directly.
+		// Release empty slabs first, and only swap if that's not enough. Pages freed by
+		// swapping needn't be contiguous, so a large block may still be missing.
+		u_int t0 = read_cp0_count();
+		if (kmem_cache_reap() == 0) {
+			swap_out(MAX(NSWAP, 1 << order));
+		}
+		vmstat.direct_reclaims++;
+		vmstat.cyc_reclaim += read_cp0_count() - t0;
+		pp = page_take(order, zero, &zeroed);
+	}
+	if (pp == NULL) {
+		return -E_NO_MEM;
 	}
+
+	/* Step 2: Initialize the pages with zero, unless they are already. */
+	if (zeroed) {
+		vmstat.prezero_hits++;
+	} else if (zero) {
+		memset((void*)page2kva(pp), 0, PAGE_SIZE << order);
+	}
+	for (u_int i = 0; i < (1 << order); i++) {
+		pp[i].swap_link.tqe_next = NULL;
+		pp[i].swap_link.tqe_prev = NULL;
+		pp[i].accessed = 0;
+		pp[i].pp_flags = 0;
+		pp[i].pp_age = 0;
+	}
+
+	*new = pp;
+	return 0;
+}
+
+/* Overview:
+ *   Allocate 2^'order' physically contiguous pages from free memory, aligned to their size, and
+ *   fill them with zero.
+ *
+ * Post-Condition:
+ *   If failed to allocate the pages (out of memory, or no free block large enough is left even
+ *   after reclaiming), return -E_NO_MEM. Return -E_INVAL if 'order' is not below PAGE_NORDER.
+ *   Otherwise, set the address of the first 'Page' of the block to *new, and return 0.
+ *
+ * Note:
+ *   Like 'page_alloc', this does NOT increase the 'pp_ref' of the pages. They may be freed
+ *   together with 'page_free_order', or one by one with 'page_free'.
+ */
+int page_alloc_order(u_int order, struct Page **new) {
+	if (order >= PAGE_NORDER) { return -E_INVAL; }
+	return page_alloc_block(order, 1, new);
 }
 
 /* Overview:
@@ -131,30 +308,42 @@ void page_init(void) {
  * Note:
  *   This does NOT increase the reference count 'pp_ref' of the page - the caller must do these if
  *   necessary (either explicitly or via page_insert).
- *
- * Hint: Use LIST_FIRST and LIST_REMOVE defined in include/queue.h.
  */
 int page_alloc(struct Page **new) {
-	/* Step 1: Get a page from free memory. If fails, return the error code.*/
-	struct Page *pp;
-	if (LIST_EMPTY(&page_free_list))
-	{
-		for (int i = 0; i < NSWAP; i++) { swap(); }
-		if (LIST_EMPTY(&page_free_list)) {
-			panic("swap err: no PPage available after swapping");
-		} 
-	}
-	pp = LIST_FIRST(&page_free_list);
-	LIST_REMOVE(pp, pp_link);
+	return page_alloc_block(0, 1, new);
+}
 
-	/* Step 2: Initialize this page with zero. */
-	memset((void*)page2kva(pp), 0, PAGE_SIZE);
-	pp->swap_link.tqe_next = NULL;
-	pp->swap_link.tqe_prev = NULL;
-	pp->accessed = 0;
+/* Overview:
+ *   Like 'page_alloc', but leave the content of the page undefined, for callers about to
+ *   overwrite it whole (e.g. with swapped data). Dirty free pages are taken first, leaving the
+ *   zeroed ones to 'page_alloc'.
+ */
+int page_alloc_nozero(struct Page **new) {
+	return page_alloc_block(0, 0, new);
+}
 
-	*new = pp;
-	return 0;
+/* Overview:
+ *   Release the block of 2^'order' pages starting at 'pp', mark it as free, and merge it with
+ *   its free buddies.
+ *
+ * Pre-Condition:
+ *   'pp->pp_ref' is '0', and the block was allocated with an order of at least 'order'.
+ */
+void page_free_order(struct Page *pp, u_int order) {
+	assert(pp->pp_ref == 0);
+	page_nfree += 1 << order;
+
+	u_long ppn = page2ppn(pp);
+	while (order < PAGE_NORDER - 1 && !page_free_stolen) {
+		u_long bppn = ppn ^ (1 << order);
+		if (bppn >= npage) { break; }
+		struct Page *buddy = &pages[bppn];
+		if (!(buddy->pp_flags & PG_BUDDY) || buddy->pp_order != order) { break; }
+		buddy_remove(buddy, order);
+		ppn &= ~(1 << order);
+		order++;
+	}
+	buddy_insert(&pages[ppn], order);
 }
 
 /* Overview:
@@ -164,10 +353,54 @@ int page_alloc(struct Page **new) {
  *   'pp->pp_ref' is '0'.
  */
 void page_free(struct Page *pp) {
-	assert(pp->pp_ref == 0);
-	/* Just insert it into 'page_free_list'. */
-	/* Exercise 2.5: Your code here. */
-	LIST_INSERT_HEAD(&page_free_list, pp, pp_link);
+	page_free_order(pp, 0);
+}
+
+/* Overview:
+ *   Take all free memory away into '*save', so that 'page_alloc' fails, for checks of the
+ *   allocator's users. Pages freed meanwhile are allocated again first (last freed first), and
+ *   are merged with the memory taken away by 'page_free_restore'.
+ */
+void page_free_steal(struct Page_free_area *save) {
+	*save = page_free_area;
+	for (u_int o = 0; o < PAGE_NORDER; o++) {
+		LIST_INIT(&page_free_area.lists[o]);
+		page_free_area.nfree[o] = 0;
+	}
+	LIST_INIT(&page_free_area.zeroed);
+	page_free_area.nzeroed = 0;
+	page_nfree = 0;
+	page_free_stolen = 1;
+}
+
+// Give back the free memory taken away by 'page_free_steal'.
+void page_free_restore(struct Page_free_area *save) {
+	struct Page_list freed;
+	struct Page *pp;
+
+	LIST_INIT(&freed);
+	for (u_int o = 0; o < PAGE_NORDER; o++) {
+		while ((pp = LIST_FIRST(&page_free_area.lists[o])) != NULL) {
+			buddy_remove(pp, o);
+			LIST_INSERT_HEAD(&freed, pp, pp_link); // 'pp_order' is kept.
+		}
+	}
+
+	while ((pp = zeroed_take()) != NULL) {
+		pp->pp_order = 0;
+		LIST_INSERT_HEAD(&freed, pp, pp_link);
+	}
+
+	page_free_area = *save; // The first blocks still link back to 'page_free_area'.
+	page_free_stolen = 0;
+	page_nfree = page_free_area.nzeroed;
+	for (u_int o = 0; o < PAGE_NORDER; o++) {
+		page_nfree += page_free_area.nfree[o] << o;
+	}
+	while ((pp = LIST_FIRST(&freed)) != NULL) {
+		LIST_REMOVE(pp, pp_link);
+		page_free_order(pp, pp->pp_order);
+	}
 }
 
 /* Overview:
@@ -197,6 +430,12 @@ static int pgdir_walk(Pde *pgdir, u_long va, int create, Pte **ppte) {
 	/* Exercise 2.6: Your code here. (1/3) */
 	pgdir_entryp = pgdir + PDX(va);
 
+	// A swapped-out page table is brought back first, like the VPage mapping it at UVPT.
+	if (!(*pgdir_entryp & PTE_V) && (*pgdir_entryp & PTE_SWAPPED)) {
+		swap_back(pgdir, UVPT + (PDX(va) << PGSHIFT), *pgdir_entryp);
+		panic_on(!(*pgdir_entryp & PTE_V));
+	}
+
 	/* Step 2: If the corresponding page table is not existent (valid) then:
 	 *   * If parameter `create` is set, create one. Set the permission bits 'PTE_C_CACHEABLE |
 	 *     PTE_V' for this new page in the page directory. If failed to allocate a new page (out
@@ -227,6 +466,14 @@ static int pgdir_walk(Pde *pgdir, u_long va, int create, Pte **ppte) {
 	return 0;
 }
 
+// The PTE of `va` in `pgdir` if its page table is resident, else NULL. A swapped-out page
+// table maps no resident page (see pgtable_scan), so walks for those needn't swap it in.
+static Pte *pgdir_peek(Pde *pgdir, u_long va) {
+	Pde pde = pgdir[PDX(va)];
+	if (!(pde & PTE_V)) { return NULL; }
+	return (Pte *)KADDR(PTE_ADDR(pde)) + PTX(va);
+}
+
 /* Overview:
  *   Map the physical page 'pp' at the page where the virtual address
  *   'va' lies. The permission (the low 12 bits) of the page table entry
@@ -249,7 +496,8 @@ int page_insert(Pde *pgdir, u_int asid, struct Page *pp, u_long va, u_int perm)
 
 	// Guarantee the ORIGINAL VPage is in physical mem.
 	if (pte && !(*pte & PTE_V) && (*pte & PTE_SWAPPED)) {
-		swap_back(*pte);
+		swap_back(pgdir, va, *pte);
+		pgdir_walk(pgdir, va, 0, &pte); // The page table may have been swapped meanwhile.
 	}
 
 	// A valid pte exist
@@ -259,7 +507,10 @@ int page_insert(Pde *pgdir, u_int asid, struct Page *pp, u_long va, u_int perm)
 			page_remove(pgdir, asid, va);
 		} else { // Same physical page
 			tlb_invalidate(asid, va);
-			*pte = page2pa(pp) | (perm & ~PTE_SWAPPED) | PTE_C_CACHEABLE | PTE_V;
+			*pte = page2pa(pp) | (perm & ~(PTE_SWAPPED | PTE_REFTRAP)) | PTE_C_CACHEABLE | PTE_V;
+			if (perm & PTE_REFETCH) {
+				refetch_mark_clean(pp);
+			}
 			return 0;
 		}
 	}
@@ -269,15 +520,22 @@ int page_insert(Pde *pgdir, u_int asid, struct Page *pp, u_long va, u_int perm)
 
 	/* Step 3: Re-get or create the page table entry. */
 	/* If failed to create, return the error. */
+	int new_pgtable = !(pgdir[PDX(va)] & (PTE_V | PTE_SWAPPED));
 	if (pgdir_walk(pgdir, va, 1, &pte) == -E_NO_MEM) {
 		return -E_NO_MEM;
 	}
+	if (new_pgtable) {
+		pgtable_register(pgdir, asid, va);
+	}
 
 	/* Step 4: Insert the page to the page table entry with 'perm | PTE_C_CACHEABLE | PTE_V'
 	 * and increase its 'pp_ref'. */
-	*pte = page2pa(pp) | (perm & ~PTE_SWAPPED) | PTE_C_CACHEABLE | PTE_V;
+	*pte = page2pa(pp) | (perm & ~(PTE_SWAPPED | PTE_REFTRAP)) | PTE_C_CACHEABLE | PTE_V;
 	pp->pp_ref++;
-	pp->accessed = 1;
+	swap_policy->access(pp);
+	if (perm & PTE_REFETCH) {
+		refetch_mark_clean(pp);
+	}
 
 	return 0;
 }
@@ -298,7 +556,8 @@ struct Page *page_lookup(Pde *pgdir, u_long va, /* for efficiency */ Pte **ppte)
 
 	// Swap back if data is on disk.
 	if (pte && !(*pte & PTE_V) && (*pte & PTE_SWAPPED)) {
-		swap_back(*pte);
+		swap_back(pgdir, va, *pte);
+		pgdir_walk(pgdir, va, 0, &pte); // The page table may have been swapped meanwhile.
 	}
 
 	/* Hint: Check if the page table entry doesn't exist or is not valid. */
@@ -315,7 +574,11 @@ struct Page *page_lookup(Pde *pgdir, u_long va, /* for efficiency */ Pte **ppte)
 	if (ppte) {
 		*ppte = pte;
 	}
-	pp->accessed = 1;
+	*pte &= ~PTE_REFTRAP; // A soft fault to sample the reference bit, if it was set.
+	swap_policy->access(pp);
+	if (pp->pp_flags & PG_READAHEAD) { // First use of a page read ahead.
+		swap_ra_hit(pp);
+	}
 
 	return pp;
 }
@@ -361,7 +624,7 @@ void page_remove(Pde *pgdir, u_int asid, u_long va) {
 
 void physical_memory_manage_check(void) {
 	struct Page *pp, *pp0, *pp1, *pp2;
-	struct Page_list fl;
+	struct Page_free_area fl;
 	int *temp;
 
 	// should be able to allocate three pages
@@ -375,9 +638,8 @@ void physical_memory_manage_check(void) {
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	// now this page_free list must be empty!!!!
-	LIST_INIT(&page_free_list);
+	// now the free area must be empty!!!!
+	page_free_steal(&fl);
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
 
@@ -397,7 +659,7 @@ void physical_memory_manage_check(void) {
 	// pp0 should be zero
 	assert(*temp == 0);
 
-	page_free_list = fl;
+	page_free_restore(&fl);
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
@@ -446,7 +708,7 @@ void physical_memory_manage_check(void) {
 
 void page_check(void) {
 	struct Page *pp, *pp0, *pp1, *pp2;
-	struct Page_list fl;
+	struct Page_free_area fl;
 
 	// should be able to allocate a page for directory
 	assert(page_alloc(&pp) == 0);
@@ -463,9 +725,8 @@ void page_check(void) {
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	// now this page_free list must be empty!!!!
-	LIST_INIT(&page_free_list);
+	// now the free area must be empty!!!!
+	page_free_steal(&fl);
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -549,7 +810,7 @@ void page_check(void) {
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	page_free_restore(&fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -564,296 +825,1307 @@ void page_check(void) {
  */
 
 
-struct Page_tailq page_swap_queue;
-
 // Swap table: index table of PPage -> PTE
 //
 // `swap_tbl` is the starting addr of an SwapTableEntry array,
-// indexed by PPN.
-// Each SwapTableEntry is a LIST_HEAD item for a list of registered
-// VPage, whose info is recorded in struct SwapInfo.
-// When a VPage of swappable type is allocated with a PPage, a SwapInfo
-// will be registered through swap_register().
-// Later when trying to swap out the page, all corresponding SwapInfos
-// will be traversed to refill the page tables, unsetting V and setting
-// software flag SWAPPED, as well as writing disk address in the PTE.
+// indexed by PPN, and `bno_tbl` the one indexed by swap block number.
+// Each SwapTableEntry is the reverse map of a page: mappings registered at the
+// same VA by envs of the same fork family share one anchor (family, va), and
+// are counted by `mapcount`; every other mapping is recorded in a SwapInfo.
+// When a VPage of swappable type is allocated with a PPage, its mapping is
+// registered through swap_register().
+// Later when trying to swap out the page, the members of the anchor family and
+// all SwapInfos are traversed to refill the page tables, unsetting V and
+// setting software flag SWAPPED, as well as writing disk address in the PTE.
 SwapTableEntry *swap_tbl;
-SwapTableEntry *bno_tbl;//[SD_NBLK];
+SwapTableEntry *bno_tbl;//[sd_nblk];
+
+// SwapInfos and AnonFamilies are allocated on demand, their memory growing
+// with the number of registered mappings and envs.
+static struct kmem_cache swapinfo_cache;
+static struct kmem_cache anon_cache;
 
-struct SwapInfo swapInfos[MAX_SWAPINFO];
-LIST_HEAD(, SwapInfo) swapInfo_free_list;
+struct vmstat vmstat;
 
 void swap_init(void) {
-	// Init swap disk bitmap.
+	// Size the swap devices, and init their bitmap.
+	sd_probe();
 	sd_bitmap_init();
 
-	// page_swap_queue
-	TAILQ_INIT(&page_swap_queue);
+	// Compressed pool
+	zswap_init();
 
-	// swap_tbl, swapInfos, swapInfo_free_list
+	// Replacement policy
+	swap_policy->init();
+	printk("swap policy: %s\n", swap_policy->name);
+
+	// swap_tbl, bno_tbl, swapinfo_cache, anon_cache
 	swap_tbl = (SwapTableEntry *)alloc(npage * sizeof(SwapTableEntry), PAGE_SIZE, 1);
-	bno_tbl = (SwapTableEntry *)alloc(SD_NBLK * sizeof(SwapTableEntry), PAGE_SIZE, 1);
-	//swapInfos = (struct SwapInfo *)alloc(MAX_SWAPINFO * sizeof(struct SwapInfo), PAGE_SIZE, 1);
-	printk("to memory %x for struct SwapInfos.\n", freemem);
-	LIST_INIT(&swapInfo_free_list);
-	for (int i = 0; i < MAX_SWAPINFO; i++) {
-		LIST_INSERT_HEAD(&swapInfo_free_list, &swapInfos[i], link);
+	bno_tbl = (SwapTableEntry *)alloc(sd_nblk * sizeof(SwapTableEntry), PAGE_SIZE, 1);
+	printk("to memory %x for swap tables.\n", freemem);
+	kmem_cache_init(&swapinfo_cache, "SwapInfo", sizeof(struct SwapInfo));
+	kmem_cache_init(&anon_cache, "AnonFamily", sizeof(struct AnonFamily));
+
+	// The shared zero page, below 'freemem' so it is never freed.
+	zero_page = pa2page(PADDR(alloc(PAGE_SIZE, PAGE_SIZE, 1)));
+	zero_page->pp_flags = PG_ZERO;
+}
+
+static void anon_put(struct AnonFamily *anon) {
+	if (--anon->refs == 0) {
+		panic_on(!LIST_EMPTY(&anon->members));
+		kmem_cache_free(&anon_cache, anon);
 	}
 }
 
-/* Register a SwapInfo in the corresponding ste in swap_tbl.
-   Called when a VPage of swappable type is accessed, requiring a PPage.
+/* Overview:
+ *   Add the new env 'e' to the fork family of 'parent', or to a new family if 'parent' is NULL.
+ *
+ * Post-Condition:
+ *   Return 0 on success, or -E_NO_MEM if a new family can't be allocated.
  */
-void swap_register(struct Page *pp, Pde *pgdir, u_int va, u_int asid) {
-	/*if ((PTE_ADDR(va) == 0x60000000 || PTE_ADDR(va) == UCOW)
-			&& (curenv->env_id == 0x1802 || curenv->env_id == 0x2802)
-			) {
-	//if (PTE_ADDR(va) == 0x7f3ff000) {
-		printk("register pgdir=%x, ppn=%d, va=0x%08x, num=%d\n", pgdir, page2ppn(pp), PTE_ADDR(va), pp->pp_ref);
-	}*/
-
-	// If it's the first time the PPage is mapped, insert it to swap_queue.
-	SwapTableEntry *pp_ste = page2ste(pp);
-	if (LIST_EMPTY(pp_ste)) {
-		TAILQ_INSERT_TAIL(&page_swap_queue, pp, swap_link);
-	}
-
-	// Get a free SwapInfo and edit it.
-	if (LIST_EMPTY(&swapInfo_free_list)) { panic("no struct SwapInfo available"); }
-	struct SwapInfo *sinfo = LIST_FIRST(&swapInfo_free_list);
-	LIST_REMOVE(sinfo, link);
-	sinfo->pgdir = pgdir;
-	sinfo->va    = PTE_ADDR(va);
-	sinfo->asid  = asid;
-
-	// Insert sinfo to corresponding list of pp.
-	SwapTableEntry *ste = page2ste(pp);
-	LIST_INSERT_HEAD(ste, sinfo, link);
+int anon_family_join(struct Env *e, struct Env *parent) {
+	struct AnonFamily *anon;
+
+	if (parent != NULL && parent->env_anon != NULL) {
+		anon = parent->env_anon;
+	} else {
+		if ((anon = kmem_cache_alloc(&anon_cache)) == NULL) { return -E_NO_MEM; }
+		LIST_INIT(&anon->members);
+		anon->refs = 0;
+	}
+	anon->refs++;
+	LIST_INSERT_HEAD(&anon->members, e, env_anon_link);
+	e->env_anon = anon;
+	return 0;
 }
 
-void swap_unregister(struct Page *pp, Pde *pgdir, u_int va, u_int asid) {
-	// Find the corresponding SwapInfo from the swap_tbl and remove it.
-	/*if ((PTE_ADDR(va) == 0x60000000 || PTE_ADDR(va) == UCOW)
-			&& (curenv->env_id == 0x1802 || curenv->env_id == 0x2802)
-			) {
-	//if (PTE_ADDR(va) == 0x7f3ff000) {
-	//if (curenv->env_id == 0x1802) {
-		printk("unregister pgdir=%x ppn=%d, va=0x%08x, num=%d\n", pgdir, page2ppn(pp), PTE_ADDR(va), pp->pp_ref);
-	}*/
+/* Overview:
+ *   Remove 'e' from its family. All mappings of 'e' must have been removed.
+ */
+void anon_family_leave(struct Env *e) {
+	LIST_REMOVE(e, env_anon_link);
+	anon_put(e->env_anon);
+	e->env_anon = NULL;
+}
 
-	struct SwapInfo *sinfo;
-	SwapTableEntry *ste = page2ste(pp);
-	if (LIST_EMPTY(ste)) { return; }
+// The family of the env mapping with 'pgdir' and 'asid', or NULL if it is unknown.
+static struct AnonFamily *mapping_family(Pde *pgdir, u_int asid) {
+#if !defined(LAB) || LAB >= 3
+	struct Env *e = asid2env(asid);
+	return (e != NULL && e->env_pgdir == pgdir) ? e->env_anon : NULL;
+#else
+	return NULL; // No envs before lab 3: every mapping is recorded by a SwapInfo.
+#endif
+}
 
-	LIST_FOREACH(sinfo, ste, link) {
-		if ((((u_int) sinfo->pgdir) == ((u_int) pgdir))
-				&& (sinfo->asid == asid)
-				&& (PTE_ADDR(sinfo->va) == PTE_ADDR(va))) {
-			LIST_REMOVE(sinfo, link);
-			LIST_INSERT_HEAD(&swapInfo_free_list, sinfo, link);
-			break;
-		}
+// Count `d` registered mappings to resident pages in the env owning `asid` (see 'env_rss').
+static void rss_add(u_int asid, int d) {
+#if !defined(LAB) || LAB >= 3
+	struct Env *e = asid2env(asid);
+	if (e != NULL) {
+		e->env_rss += d;
 	}
+#endif
+}
 
-	if (LIST_EMPTY(ste)) {
-		if (pp->swap_link.tqe_next || pp->swap_link.tqe_prev) {
-			TAILQ_REMOVE(&page_swap_queue, pp, swap_link); // Remove the PPage from swappable queue.
-			pp->swap_link.tqe_next = NULL;
-			pp->swap_link.tqe_prev = NULL;
+static inline int ste_anchored(SwapTableEntry *ste, struct AnonFamily *anon, u_int va) {
+	return anon != NULL && ste->mapcount != 0 && ste->anon == anon && ste->va == va;
+}
+
+// Whether 'ste' maps a page table, always anchored at its VA in UVPT (see pgtable_register).
+static inline int ste_pgtable(SwapTableEntry *ste) {
+	return ste->mapcount != 0 && ste->va >= UVPT;
+}
+
+// Re-anchor 'ste' on the first SwapInfo with a known family, folding every SwapInfo
+// covered by the new anchor into 'mapcount'.
+// Called when the last mapping under the old anchor is gone.
+static void ste_reanchor(SwapTableEntry *ste) {
+	struct SwapInfo *sinfo, *next;
+
+	LIST_FOREACH(sinfo, &ste->sinfos, link) {
+		if (sinfo->anon != NULL) { break; }
+	}
+	if (sinfo == NULL) { return; }
+
+	ste->anon = sinfo->anon;
+	ste->anon->refs++;
+	ste->va = sinfo->va;
+	for (sinfo = LIST_FIRST(&ste->sinfos); sinfo != NULL; sinfo = next) {
+		next = LIST_NEXT(sinfo, link);
+		if (sinfo->anon == ste->anon && sinfo->va == ste->va) {
+			LIST_REMOVE(sinfo, link);
+			kmem_cache_free(&swapinfo_cache, sinfo);
+			ste->mapcount++;
 		}
 	}
 }
 
-void swap_back(Pte cur_pte) {
-	//printk("back\n");
-	// Allocate a page.
-	struct Page *p;
-	panic_on(page_alloc(&p));
+// Move the reverse map in 'from' to the empty entry 'to'.
+static void ste_move(SwapTableEntry *to, SwapTableEntry *from) {
+	struct SwapInfo *sinfo;
 
-	// Recover swapped data from the disk block.
-	u_int sd_bno = cur_pte >> PGSHIFT;
-	panic_on(sd_bno >= SD_NBLK);
-	read_page(p, sd_bno);
-	sd_block_free(sd_bno);
+	to->anon = from->anon;
+	to->va = from->va;
+	to->mapcount = from->mapcount;
+	from->anon = NULL;
+	from->mapcount = 0;
+	while (!LIST_EMPTY(&from->sinfos)) {
+		sinfo = LIST_FIRST(&from->sinfos);
+		LIST_REMOVE(sinfo, link);
+		LIST_INSERT_HEAD(&to->sinfos, sinfo, link);
+	}
+}
 
-	// For all VPage of this swapped page, recover:
-	SwapTableEntry *bno_ste = bno2ste(sd_bno);
+// Drop all the mappings recorded in `ste`.
+static void ste_clear(SwapTableEntry *ste) {
 	struct SwapInfo *sinfo;
-	assert(p->pp_ref == 0);
-	LIST_FOREACH(sinfo, bno_ste, link) {
-		// Recover PTE.
-		Pde pde = sinfo->pgdir[PDX(sinfo->va)];
-		Pte *pte = (Pte *)KADDR( PTE_ADDR(pde) ) + PTX(sinfo->va);
 
-		panic_on(*pte & PTE_V);
-		panic_on(!(*pte & PTE_SWAPPED));
+	if (ste->mapcount != 0) {
+		anon_put(ste->anon);
+		ste->anon = NULL;
+		ste->mapcount = 0;
+	}
+	while (!LIST_EMPTY(&ste->sinfos)) {
+		sinfo = LIST_FIRST(&ste->sinfos);
+		LIST_REMOVE(sinfo, link);
+		kmem_cache_free(&swapinfo_cache, sinfo);
+	}
+}
 
-		*pte |= PTE_V;
-		*pte &= ~PTE_SWAPPED;
-		*pte = PTE_FLAGS(*pte);
-		*pte |= PTE_ADDR(page2pa(p));
+static inline Pte *sinfo2pte(struct SwapInfo *sinfo) {
+	Pde pde = sinfo->pgdir[PDX(sinfo->va)];
+	return (Pte *)KADDR( PTE_ADDR(pde) ) + PTX(sinfo->va);
+}
 
-		//tlb_invalidate(sinfo->asid, sinfo->va); // Invalidate corresponding TLB entry.
-		/*if ((sinfo->va == 0x60000000) && (curenv->env_id == 0x2802 || curenv->env_id == 0x1802)) {
-			printk("in:  ");
-			_print_sinfo(sinfo); 
-		}*/
+/* Call `fn(pte, asid, va, arg)` on every registered mapping of the resident PPage `pp`, and
+   return the number of mappings.
+ */
+static u_int rmap_walk(struct Page *pp,
+		void (*fn)(Pte *pte, u_int asid, u_int va, void *arg), void *arg) {
+	SwapTableEntry *ste = page2ste(pp);
+	struct SwapInfo *sinfo;
+	Pte *pte;
+	u_int n = 0;
+
+	// 1. Mappings under the anchor: walk the family for those still mapping `pp`.
+	if (ste->mapcount != 0) {
+		struct Env *e;
+		LIST_FOREACH(e, &ste->anon->members, env_anon_link) {
+			pte = pgdir_peek(e->env_pgdir, ste->va);
+			if (pte && (*pte & PTE_V) && pa2page(*pte) == pp) {
+				fn(pte, e->env_asid, ste->va, arg);
+				n++;
+			}
+		}
+		if (n != ste->mapcount) {
+			panic("anchor va %x: mapcount %d, but %d mappings found", ste->va, ste->mapcount,
+			      n);
+		}
+	}
+	// 2. Mappings recorded by SwapInfos.
+	LIST_FOREACH(sinfo, &ste->sinfos, link) {
+		fn(sinfo2pte(sinfo), sinfo->asid, sinfo->va, arg);
+		n++;
+	}
+	return n;
+}
 
-		p->pp_ref++;
+static void pte_arm_reftrap(Pte *pte, u_int asid, u_int va, void *arg) {
+	*pte |= PTE_REFTRAP;
+	tlb_invalidate(asid, va);
 }
-	TAILQ_INSERT_TAIL(&page_swap_queue, p, swap_link);
 
-	// Move SwapInfo from bno_ste to page_ste.
-	SwapTableEntry *ste = page2ste(p);
-	while (!LIST_EMPTY(bno_ste)) {
-		sinfo = LIST_FIRST(bno_ste);
-		LIST_REMOVE(sinfo, link);
-		LIST_INSERT_HEAD(ste, sinfo, link);
-	}
-	//printk("end back\n");
+/* Clear the reference bit of `pp`, for the replacement policy.
+   Loads and stores hit in the TLB are not seen by the kernel, so every mapping of `pp` is
+   also dropped from the TLB and marked PTE_REFTRAP: its next refill is refused (see
+   _do_tlb_refill), and the resulting soft fault sets the bit again in page_lookup.
+ */
+void swap_clear_ref(struct Page *pp) {
+	pp->accessed = 0;
+	rmap_walk(pp, pte_arm_reftrap, NULL);
 }
 
-// Pick a page in memory and swap it out to the swapping disk.
-void swap(void) {
-	// Get a PPage from page_swap_queue.
-	if (TAILQ_EMPTY(&page_swap_queue)) { return;/*panic("no swappable page");*/ }
+/* Record a mapping in `ste`, the reverse map of the resident PPage `pp` or of a swap block
+   (`pp` NULL). A mapping covered by the anchor costs no allocation.
+ */
+static void ste_register(SwapTableEntry *ste, struct Page *pp, Pde *pgdir, u_int va, u_int asid) {
+	struct AnonFamily *anon = mapping_family(pgdir, asid);
+
+	va = PTE_ADDR(va);
+	if (anon != NULL && ste->mapcount == 0) { // Anchor the page here.
+		ste->anon = anon;
+		anon->refs++;
+		ste->va = va;
+		ste->mapcount = 1;
+	} else if (ste_anchored(ste, anon, va)) {
+		ste->mapcount++;
+	} else {
+		// Get a free SwapInfo and edit it.
+		// Growing the cache may reclaim memory, so keep `pp` from being swapped meanwhile.
+		u_short pinned = pp != NULL ? pp->pp_flags & PG_PINNED : 0;
+		if (pp != NULL) { pp->pp_flags |= PG_PINNED; }
+		struct SwapInfo *sinfo = kmem_cache_alloc(&swapinfo_cache);
+		if (sinfo == NULL) { panic("no struct SwapInfo available"); }
+		if (pp != NULL) { pp->pp_flags = (pp->pp_flags & ~PG_PINNED) | pinned; }
+
+		sinfo->pgdir = pgdir;
+		sinfo->va    = va;
+		sinfo->asid  = asid;
+		sinfo->anon  = anon;
+		LIST_INSERT_HEAD(&ste->sinfos, sinfo, link);
+	}
+}
 
-	// Second-chance Clock.
-	static struct Page *last_next = NULL;
-	if (!last_next) { last_next = TAILQ_FIRST(&page_swap_queue); }
-	struct Page *pp = last_next;
-	int max = 100;
-	while (1) {
-		if (TAILQ_NEXT(pp, swap_link)) {
-			pp = TAILQ_NEXT(pp, swap_link);
-		} else { // Jump to the first on the end.
-			pp = TAILQ_FIRST(&page_swap_queue);
-		}
-		if (pp == last_next) { break; } // We came back after a full circle.
-		if (pp->accessed == 1) {
-			pp->accessed = 0;
-		} else {
-			if (--max <= 0) { break; }
+// Remove a mapping from `ste`, and return whether it was recorded there.
+// O(1) for a mapping covered by the anchor.
+static int ste_unregister(SwapTableEntry *ste, Pde *pgdir, u_int va, u_int asid) {
+	struct AnonFamily *anon = mapping_family(pgdir, asid);
+	va = PTE_ADDR(va);
+	if (ste_anchored(ste, anon, va)) {
+		if (--ste->mapcount == 0) {
+			anon_put(ste->anon);
+			ste->anon = NULL;
+			ste_reanchor(ste);
 		}
+		return 1;
 	}
-	last_next = (TAILQ_NEXT(pp, swap_link) != NULL) ?
-		TAILQ_NEXT(pp, swap_link) : TAILQ_FIRST(&page_swap_queue);
-
-	// Write PPage data to a disk block.
-	int sd_bno = sd_block_alloc();
-	panic_on(sd_bno >= SD_NBLK);
-	write_page(pp, sd_bno);
-	//printk("page #0x%d data swapped to disk\n", page2ppn(pp));
 
-	// Refresh the PTE of all VPage mapping the swapped PPage and flush all TLB entries.
 	struct SwapInfo *sinfo;
-	SwapTableEntry *ste = page2ste(pp);
-	LIST_FOREACH(sinfo, ste, link) {
-		Pde pde = sinfo->pgdir[PDX(sinfo->va)];
-		Pte *pte = (Pte *)KADDR( PTE_ADDR(pde) ) + PTX(sinfo->va);
+	LIST_FOREACH(sinfo, &ste->sinfos, link) {
+		if ((((u_int) sinfo->pgdir) == ((u_int) pgdir))
+				&& (sinfo->asid == asid)
+				&& (sinfo->va == va)) {
+			LIST_REMOVE(sinfo, link);
+			kmem_cache_free(&swapinfo_cache, sinfo);
+			return 1;
+		}
+	}
+	return 0;
+}
 
-		panic_on(!(*pte & PTE_V));
-		panic_on(*pte & PTE_SWAPPED);
+/* Register a mapping of the PPage in the corresponding ste in swap_tbl.
+   Called when a VPage of swappable type is accessed, requiring a PPage.
+ */
+void swap_register(struct Page *pp, Pde *pgdir, u_int va, u_int asid) {
+	SwapTableEntry *ste = page2ste(pp);
+	int mapped = ste_mapped(ste);
 
-		*pte &= ~PTE_V;  	 		// Unset V.
-		*pte |= PTE_SWAPPED; 		// Set soft-flag SWAPPED.
-		*pte = PTE_FLAGS(*pte); 	// Clear PTE's PAddr field.
-		*pte |= PTE_ADDR(sd_bno << PGSHIFT); // Set addr to sd_bno.
+	ste_register(ste, pp, pgdir, va, asid);
+	rss_add(asid, 1);
 
-		tlb_invalidate(sinfo->asid, sinfo->va); // Invalidate corresponding TLB entry.
+	// If it's the first time the PPage is mapped, hand it to the replacement policy.
+	if (!mapped) {
+		swap_policy->insert(pp);
+	}
+}
 
-		/*if ((sinfo->va == 0x60000000) && (curenv->env_id == 0x2802 || curenv->env_id == 0x1802)) {
-			printk("out: ");
-			_print_sinfo(sinfo);
-		}*/
+/* Remove a mapping of the PPage from the corresponding ste in swap_tbl.
+ */
+void swap_unregister(struct Page *pp, Pde *pgdir, u_int va, u_int asid) {
+	SwapTableEntry *ste = page2ste(pp);
+	if (!ste_mapped(ste)) { return; }
 
-		pp->pp_ref--;
+	if (ste_unregister(ste, pgdir, va, asid)) {
+		rss_add(asid, -1);
 	}
 
-	if (pp->pp_ref != 0) {
-		printk("pp_ref=%d\n", pp->pp_ref);
-		LIST_FOREACH(sinfo, ste, link) { _print_sinfo(sinfo); }
+	if (!ste_mapped(ste)) {
+		swap_cache_drop(pp);
+		if (pp->swap_link.tqe_next || pp->swap_link.tqe_prev) {
+			swap_policy->remove(pp); // Take the PPage away from the replacement policy.
+		}
 	}
-	panic_on(pp->pp_ref != 0);
+}
 
-	// Move sinfos from swap_tbl to bno_tbl.
-	SwapTableEntry *bno_ste = bno2ste(sd_bno);
-	while (!LIST_EMPTY(ste)) {
-		sinfo = LIST_FIRST(ste);
-		LIST_REMOVE(sinfo, link);
-		LIST_INSERT_HEAD(bno_ste, sinfo, link);
-	}
+// Point a swapped-out PTE back at PPage `p`.
+static void pte_swap_in(Pte *pte, struct Page *p) {
+	panic_on(*pte & PTE_V);
+	panic_on(!(*pte & PTE_SWAPPED));
 
-	// Free the PPage.
+	*pte |= PTE_V;
+	*pte &= ~PTE_SWAPPED;
+	*pte = PTE_FLAGS(*pte);
+	*pte |= PTE_ADDR(page2pa(p));
+	p->pp_ref++;
+}
 
-	TAILQ_REMOVE(&page_swap_queue, pp, swap_link);
-	pp->swap_link.tqe_next = NULL;
-	pp->swap_link.tqe_prev = NULL;
+/* Map the swapped-out VPage at `srcva` in `srcpgdir` at `va` in `pgdir` too, with `perm`,
+ * leaving its data in swap: the new mapping is recorded in the reverse map of the block, and
+ * swapped in with the others on the first fault. Anything mapped at `va` is unmapped.
+ *
+ * Post-Condition:
+ *   Return 0 on success.
+ *   Return -E_INVAL if the source VPage is not swapped out (any more); map it resident then.
+ *   Return -E_NO_MEM if a page table couldn't be allocated.
+ */
+int swap_share(Pde *srcpgdir, u_long srcva, Pde *pgdir, u_int asid, u_long va, u_int perm) {
+	Pte *pte;
+	Pte swapped = PTE_FLAGS(perm & ~(PTE_V | PTE_REFTRAP)) | PTE_C_CACHEABLE | PTE_SWAPPED;
 
-	LIST_INSERT_HEAD(&page_free_list, pp, pp_link);
+	// Step 1: Find the swap block.
+	pgdir_walk(srcpgdir, srcva, 0, &pte);
+	if (pte == NULL || (*pte & PTE_V) || !(*pte & PTE_SWAPPED)) { return -E_INVAL; }
+	u_int bno = *pte >> PGSHIFT;
+	swapped |= bno << PGSHIFT;
 
-	//printk("end swap\n");
-}
+	// Step 2: Unmap the VPage at `va`, unless it maps the block already.
+	pgdir_walk(pgdir, va, 0, &pte);
+	if (pte && !(*pte & PTE_V) && (*pte & PTE_SWAPPED) && (*pte >> PGSHIFT) == bno) {
+		*pte = swapped;
+		tlb_invalidate(asid, va);
+		return 0;
+	}
+	page_remove(pgdir, asid, va);
 
-void _print_sinfo(struct SwapInfo *sinfo) {
-	if (!sinfo) {
-		printk("SwapInfo: null\n"); 
-		return;
+	// Swapping in the old page may have read the block ahead as well.
+	pgdir_walk(srcpgdir, srcva, 0, &pte);
+	if (pte == NULL || (*pte & PTE_V) || !(*pte & PTE_SWAPPED) || (*pte >> PGSHIFT) != bno) {
+		return -E_INVAL;
 	}
 
-	Pde pde = sinfo->pgdir[PDX(sinfo->va)];
-	Pte *pte = (Pte *)KADDR( PTE_ADDR(pde) ) + PTX(sinfo->va);
-	printk(
-			"SwapInfo:\t"
-			"vaddr=%x  "
-			"pgdir=%x  "
-			"pte=%x\n"
-			, sinfo->va, sinfo->pgdir, *pte
-		  );
+	// Step 3: Record the mapping, then make its PTE: neither reads the block back, but
+	// either may reclaim memory and free an empty page table.
+	ste_register(bno2ste(bno), NULL, pgdir, va, asid);
+	int new_pgtable = !(pgdir[PDX(va)] & (PTE_V | PTE_SWAPPED));
+	if (pgdir_walk(pgdir, va, 1, &pte) == -E_NO_MEM) {
+		ste_unregister(bno2ste(bno), pgdir, va, asid);
+		return -E_NO_MEM;
+	}
+	if (new_pgtable) {
+		pgtable_register(pgdir, asid, va);
+	}
+	*pte = swapped;
+	vmstat.swap_shares++;
+	return 0;
 }
 
-
-/* sdisk.c
- * Operations on swapping disk.
- * This is a CPU friendly PIO SWAP driver.
+/* Return the number of mappings of the page mapped at `va` in `pgdir`, as its 'pp_ref' if
+ * it's resident, or as counted by the reverse map of its swap block if it's swapped out, which
+ * is not read back. Return 0 if `va` maps no page.
  */
+u_int swap_pageref(Pde *pgdir, u_long va) {
+	Pte *pte;
+	pgdir_walk(pgdir, va, 0, &pte);
+	if (pte == NULL) { return 0; }
+	if (*pte & PTE_V) { return pa2page(*pte)->pp_ref; }
+	if (!(*pte & PTE_SWAPPED)) { return 0; }
 
-int sd_bitmap[SD_NBLK / 32 + 1]; // Bits unset on free.
-
-int sd_block_alloc() {
-	int bno;
-	for (bno = 0; bno < SD_NBLK; bno++) {
-		if ((sd_bitmap[bno / 32] & (1 << (bno % 32))) == 0) {
-			sd_bitmap[bno / 32] |= (1 << (bno % 32));
-			if (bno >= 0xfffff) { panic("sd_bno too big"); }
-			return bno;
-		}
+	// Every mapping of a swapped page is registered (see swap_unmap_page).
+	SwapTableEntry *ste = bno2ste(*pte >> PGSHIFT);
+	struct SwapInfo *sinfo;
+	u_int n = ste->mapcount;
+	LIST_FOREACH(sinfo, &ste->sinfos, link) {
+		n++;
 	}
-	panic("swap disk out of space");
+	return n;
 }
 
-void sd_block_free(u_int bno) {
-	sd_bitmap[bno / 32] &= ~(1 << (bno % 32));
+/* Zero page
+ *
+ * A first load from a swappable VPage maps the shared zero page (see
+ * passive_alloc), and a victim found all zero is not written to swap but has
+ * its mappings moved to the zero page. The zero page is not registered for
+ * swap, and is loaded read-only in the TLB: the first store to it gives the
+ * VPage its own page (see do_tlb_mod).
+ */
+struct Page *zero_page;
+
+/* Give the VPage at `va`, mapping the zero page, its own zeroed page with the same permissions.
+   Return 0 on success, or -E_NO_MEM.
+ */
+int zero_page_break(Pde *pgdir, u_int asid, u_long va) {
+	struct Page *pp;
+	Pte *pte;
+
+	pgdir_walk(pgdir, va, 0, &pte);
+	panic_on(pte == NULL || pa2page(*pte) != zero_page);
+	u_int perm = PTE_FLAGS(*pte);
+
+	try(page_alloc(&pp));
+	try(page_insert(pgdir, asid, pp, PTE_ADDR(va), perm));
+	if (va < USTACKTOP - PAGE_SIZE) {
+		swap_register(pp, pgdir, PTE_ADDR(va), asid);
+	}
+	return 0;
 }
 
-void sd_bitmap_init() {
-	// Clear sd_bitmap to 0.
-	for (int i = 0; i < SD_NBLK / 32 + 1; i++) {
-		sd_bitmap[i] = 0;
+static int page_is_zero(struct Page *pp) {
+	u_long *p = (u_long *)page2kva(pp);
+	for (u_int i = 0; i < PAGE_SIZE / sizeof(u_long); i++) {
+		if (p[i] != 0) { return 0; }
 	}
+	return 1;
 }
 
-static int read_sd(u_int va, u_int pa, u_int len) {
-	// Check length, only byte, half-word and word.
-	if (len != 1 && len != 2 && len != 4) { return -E_INVAL; }
-	// Check pa.
-	int valid_pa = 0;
-	valid_pa |= (0x18000170 <= pa && pa + len <= 0x18000170 + 0x8) ? 1 : 0; // swap disk
-	if (valid_pa == 0) { return -E_INVAL; };
+/* Page tables
+ *
+ * The page tables of an env are swappable pages like its data, mapped by their
+ * PDEs through the self-mapping at UVPT: a swapped-out page table leaves a
+ * swapped PDE, and pgdir_walk brings it back on the next walk, as a refill of
+ * its VA in UVPT does for the user. Only a page table mapping no resident page
+ * is taken as a victim, so that the reverse maps of resident pages never point
+ * into a swapped page table, and an empty one is freed outright.
+ */
 
-	// Perform read and return.
-	memcpy((void*)va, (void*)(KSEG1 + pa), (size_t)len);
-	return 0;
+// Make the page table of `pgdir` covering `va`, just made, swappable if `pgdir` is an env's.
+void pgtable_register(Pde *pgdir, u_int asid, u_long va) {
+	if (va >= UTOP || mapping_family(pgdir, asid) == NULL) { return; }
+	struct Page *pp = pa2page(pgdir[PDX(va)]);
+	pp->pp_flags |= PG_PGTABLE;
+	swap_register(pp, pgdir, UVPT + (PDX(va) << PGSHIFT), asid);
+}
+
+// Bring back the page table of `pgdir` covering `va` if it is swapped out.
+void pgtable_swap_in(Pde *pgdir, u_long va) {
+	Pte *pte;
+	pgdir_walk(pgdir, va, 0, &pte);
+}
+
+// Return -1 if the page table `pp` maps a resident page, 0 if it's empty, and 1 if it only
+// maps swapped pages.
+static int pgtable_scan(struct Page *pp) {
+	Pte *pt = (Pte *)page2kva(pp);
+	int r = 0;
+	for (u_int i = 0; i < PAGE_SIZE / sizeof(Pte); i++) {
+		if (pt[i] & PTE_V) { return -1; }
+		if (pt[i] != 0) { r = 1; }
+	}
+	return r;
+}
+
+static void pte_clear(Pte *pte, u_int asid, u_int va, void *arg) {
+	*pte = 0;
+	rss_add(asid, -1);
+	tlb_invalidate(asid, va);
+}
+
+// Unmap `pp` everywhere and free it, dropping its data: an empty page table, as if it had
+// never been made, or a clean refetchable page, which its envs will fetch again.
+static void page_drop(struct Page *pp) {
+	pp->pp_ref -= rmap_walk(pp, pte_clear, NULL);
+	panic_on(pp->pp_ref != 0);
+	ste_clear(page2ste(pp));
+	page_free(pp);
+}
+
+/* Swap cache
+ *
+ * A page read back from swap keeps its block, flagged PG_SWAPCACHE, as long as
+ * it stays clean. Evicting it again then needs no write. The refill handler
+ * loads such a page without PTE_D, so the first store to it takes a TLB Mod
+ * exception, which drops the copy (see do_tlb_mod).
+ */
+
+// Pages with a copy in swap, by their entry in swap_tbl, oldest copy first.
+static TAILQ_HEAD(, SwapTableEntry) swap_cache = TAILQ_HEAD_INITIALIZER(swap_cache);
+
+// Keep swap block `bno` as a copy of `pp`.
+static void swap_cache_add(struct Page *pp, u_int bno) {
+	SwapTableEntry *ste = page2ste(pp);
+	pp->pp_flags |= PG_SWAPCACHE;
+	ste->cache_bno = bno;
+	TAILQ_INSERT_TAIL(&swap_cache, ste, cache_link);
+}
+
+// Take `pp` out of the swap cache, and return its block, now the caller's.
+static u_int swap_cache_take(struct Page *pp) {
+	SwapTableEntry *ste = page2ste(pp);
+	pp->pp_flags &= ~PG_SWAPCACHE;
+	TAILQ_REMOVE(&swap_cache, ste, cache_link);
+	return ste->cache_bno;
+}
+
+// Forget the copy of `pp` in swap, as the page is dirtied or no longer mapped.
+void swap_cache_drop(struct Page *pp) {
+	if (!(pp->pp_flags & PG_SWAPCACHE)) { return; }
+	sd_block_free(swap_cache_take(pp));
+}
+
+/* Refetchable pages
+ *
+ * An env caching data it can fetch again, like the file server's disk blocks,
+ * maps the page PTE_REFETCH once it holds a clean copy. Like a swap cache page,
+ * the page is then loaded read-only and flagged PG_CLEAN until the first store
+ * through any of its mappings (see do_tlb_mod). A victim still clean and mapped
+ * PTE_REFETCH only is dropped instead of swapped out: its VPages become
+ * unmapped, and the env fetches the data again when it finds them so.
+ */
+
+static void pte_tlb_invalidate(Pte *pte, u_int asid, u_int va, void *arg) {
+	tlb_invalidate(asid, va);
+}
+
+// Mark `pp` clean, just mapped PTE_REFETCH: the next store to it takes a TLB Mod exception.
+void refetch_mark_clean(struct Page *pp) {
+	pp->pp_flags |= PG_CLEAN;
+	rmap_walk(pp, pte_tlb_invalidate, NULL);
+}
+
+static void pte_count_refetch(Pte *pte, u_int asid, u_int va, void *pn) {
+	if (*pte & PTE_REFETCH) { (*(u_int *)pn)++; }
+}
+
+// Whether the victim `pp` may be dropped: clean, and fetched again by all its mappings.
+static int refetch_ok(struct Page *pp) {
+	if (!(pp->pp_flags & PG_CLEAN)) { return 0; }
+	u_int n = 0;
+	u_int m = rmap_walk(pp, pte_count_refetch, &n);
+	return m == n && n == pp->pp_ref;
+}
+
+// Drop copies of resident pages, oldest first, until `n` swap blocks are free, when swap runs
+// short.
+static void swap_cache_shrink(u_int n) {
+	SwapTableEntry *ste;
+	while (sd_nfree < n && (ste = TAILQ_FIRST(&swap_cache)) != NULL) {
+		swap_cache_drop(&pages[ste - swap_tbl]);
+	}
+}
+
+// Restore the mappings of swap block `sd_bno`, whose data is now in `p`.
+// The block is kept as a clean copy of `p`, unless `p` is a page table.
+// Page tables holding the mappings are swapped in as needed.
+static void swap_map_back(struct Page *p, u_int sd_bno) {
+	SwapTableEntry *bno_ste = bno2ste(sd_bno);
+	int pgtable = ste_pgtable(bno_ste);
+	if (pgtable) {
+		p->pp_flags |= PG_PGTABLE;
+		vmstat.pt_swapins++;
+	} else {
+		swap_cache_add(p, sd_bno);
+	}
+
+	// For all VPage of this swapped page, recover PTE:
+	struct SwapInfo *sinfo;
+	Pte *pte;
+	assert(p->pp_ref == 0);
+	// 1. under the anchor, found in the family members still holding the block;
+	if (bno_ste->mapcount != 0) {
+		struct Env *e;
+		LIST_FOREACH(e, &bno_ste->anon->members, env_anon_link) {
+			pgdir_walk(e->env_pgdir, bno_ste->va, 0, &pte);
+			if (pte && !(*pte & PTE_V) && (*pte & PTE_SWAPPED)
+					&& (*pte >> PGSHIFT) == sd_bno) {
+				pte_swap_in(pte, p);
+				rss_add(e->env_asid, 1);
+			}
+		}
+		panic_on(p->pp_ref != bno_ste->mapcount);
+	}
+	// 2. recorded by SwapInfos.
+	LIST_FOREACH(sinfo, &bno_ste->sinfos, link) {
+		pgdir_walk(sinfo->pgdir, sinfo->va, 0, &pte);
+		pte_swap_in(pte, p);
+		rss_add(sinfo->asid, 1);
+	}
+	p->pp_age = bno_ste->pp_age;
+	swap_policy->insert(p);
+
+	// Move the reverse map from bno_ste to page_ste.
+	ste_move(page2ste(p), bno_ste);
+
+	// The kernel writes page tables without TLB Mod exceptions, so their copy can't be trusted.
+	if (pgtable) {
+		sd_block_free(sd_bno);
+	}
+}
+
+// Swap-in readahead window, in pages. It grows by one for every readahead page
+// that gets used (see page_lookup), and halves whenever one is reclaimed unused.
+static u_int ra_window = SWAP_RA_INIT;
+// The address space and VA of the last page swapped in, to detect sequential faults.
+static Pde *ra_last_pgdir;
+static u_long ra_last_va;
+
+void swap_ra_hit(struct Page *pp) {
+	pp->pp_flags &= ~PG_READAHEAD;
+	if (ra_window < SWAP_RA_MAX) { ra_window++; }
+}
+
+static void swap_ra_miss(struct Page *pp) {
+	pp->pp_flags &= ~PG_READAHEAD;
+	ra_window /= 2;
+}
+
+/* Swap-in I/O
+ *
+ * Disk reads of swap_back are queued to the interrupt-driven driver. A fault
+ * from user mode blocks the faulting env on the read of its page, and other
+ * envs run meanwhile; once the read is done, its pages are mapped back and the
+ * env is woken up to retry the access. Faults taken in the kernel poll for
+ * their read instead, and so do all faults before lab 3, which has no envs.
+ */
+
+// Set by the refill handler on a fault from user mode, so that swap_back may block 'curenv'.
+int swap_in_may_block;
+
+// Map back the pages of the finished reads, and wake up the envs waiting for them.
+void swap_io_complete(void) {
+	struct sd_req *r;
+	while ((r = sd_reap()) != NULL) {
+		for (u_int i = 0; i < r->n; i++) {
+			swap_map_back(r->pps[i], r->bno + i);
+			if ((int)i != r->fault) { r->pps[i]->pp_flags |= PG_READAHEAD; }
+		}
+#if !defined(LAB) || LAB >= 3
+		struct Env *e;
+		while ((e = LIST_FIRST(&r->waiters)) != NULL) {
+			LIST_REMOVE(e, env_swap_link);
+			e->env_swap_req = NULL;
+			e->env_status = ENV_RUNNABLE;
+			TAILQ_INSERT_TAIL(&env_sched_list, e, env_sched_link);
+		}
+#endif
+		sd_req_free(r);
+	}
+}
+
+// Wait for a read to finish when no env can run. Return 0 if there is none.
+int swap_io_wait(void) {
+	if (!sd_wait_any()) { return 0; }
+	swap_io_complete();
+	return 1;
+}
+
+// The swap disk interrupt, taken in user mode.
+void swap_intr(void) {
+	sd_intr();
+	swap_io_complete();
+}
+
+// Wait for the read `r` of a swapped page, blocking 'curenv' if `may_block`. Blocking
+// doesn't return: the faulting access is run again once the env is woken up.
+static void swap_in_wait(struct sd_req *r, int may_block) {
+#if !defined(LAB) || LAB >= 3
+	if (may_block && !r->done) {
+		vmstat.swapin_waits++;
+		curenv->env_status = ENV_NOT_RUNNABLE;
+		TAILQ_REMOVE(&env_sched_list, curenv, env_sched_link);
+		LIST_INSERT_HEAD(&r->waiters, curenv, env_swap_link);
+		curenv->env_swap_req = r;
+		schedule(1);
+	}
+#endif
+	sd_wait(r);
+	swap_io_complete();
+}
+
+/* Swap in the page mapped at `va` in `pgdir`, whose PTE is `cur_pte`.
+ *
+ * Swapped pages following `va` in the same address space, whose blocks lie
+ * within SWAP_RA_MAX of the faulting one, are read ahead up to `ra_window`
+ * pages while enough memory is free. They are mapped like the faulting page
+ * but flagged PG_READAHEAD, and kept out of the TLB until their first use.
+ * Pages on consecutive blocks are read by one disk command. Disk reads are
+ * asynchronous (see swap_in_wait): only the faulting page is waited for.
+ */
+void swap_back(Pde *pgdir, u_long va, Pte cur_pte) {
+	struct Page *batch[SWAP_RA_MAX + 1];
+	u_int bnos[SWAP_RA_MAX + 1];
+	int loaded[SWAP_RA_MAX + 1];
+	struct sd_req *wait = NULL;
+	u_int n = 0;
+	Pte *pte;
+	int may_block = swap_in_may_block;
+	swap_in_may_block = 0;
+
+	u_int sd_bno = cur_pte >> PGSHIFT;
+	panic_on(sd_bno >= sd_nblk);
+	vmstat.majflts++;
+#if !defined(LAB) || LAB >= 3
+	if (curenv != NULL) {
+		curenv->env_majflt++; // For load control.
+	}
+#endif
+
+	// The block may be on its way in already, e.g. read ahead.
+	struct sd_req *r = sd_req_find(sd_bno);
+	if (r != NULL) {
+		swap_in_wait(r, may_block);
+		return;
+	}
+	bnos[n++] = sd_bno;
+	u_int t0 = read_cp0_count();
+
+	// Step 1: Pick the swapped neighbours to read ahead.
+	va = PTE_ADDR(va);
+	if (ra_window == 0 && pgdir == ra_last_pgdir && va == ra_last_va + PAGE_SIZE) {
+		ra_window = 1; // Sequential faults: try again.
+	}
+	for (u_int i = 1; i <= ra_window && page_nfree > SWAP_RA_RESERVE + n; i++) {
+		u_long nva = va + i * PAGE_SIZE;
+		if (nva >= UTOP) { break; }
+		pte = pgdir_peek(pgdir, nva);
+		if (pte == NULL || (*pte & PTE_V) || !(*pte & PTE_SWAPPED)) { continue; }
+
+		u_int bno = *pte >> PGSHIFT;
+		if (bno + SWAP_RA_MAX < sd_bno || bno > sd_bno + SWAP_RA_MAX) { continue; }
+		if (sd_req_find(bno) != NULL) { continue; } // Being read already.
+		u_int j;
+		for (j = 0; j < n && bnos[j] != bno; j++) {}
+		if (j < n) { continue; } // Same page mapped twice.
+		bnos[n++] = bno;
+		ra_last_va = nva;
+	}
+	if (n == 1) { ra_last_va = va; }
+	ra_last_pgdir = pgdir;
+
+	// Step 2: Allocate the pages. The swapped data overwrites them whole.
+	for (u_int i = 0; i < n; i++) {
+		panic_on(page_alloc_nozero(&batch[i]));
+	}
+
+	// Step 3: Recover swapped data from the compressed pool, or else queue reads of the
+	// disk blocks, one request per run. Without free requests, read them in place.
+	for (u_int i = 0; i < n; i++) {
+		loaded[i] = zswap_load(batch[i], bnos[i]) == 0;
+	}
+	for (u_int i = 0; i < n;) {
+		if (loaded[i]) {
+			i++;
+			continue;
+		}
+		u_int len = 1;
+		while (i + len < n && len < SWAP_CLUSTER && bnos[i + len] == bnos[i] + len
+				&& !loaded[i + len]) {
+			len++;
+		}
+		if ((r = sd_read_async(batch + i, bnos[i], len)) == NULL) {
+			read_pages(batch + i, bnos[i], len);
+			for (u_int j = i; j < i + len; j++) {
+				loaded[j] = 1;
+			}
+		} else if (i == 0) {
+			r->fault = 0;
+			wait = r;
+		}
+		i += len;
+	}
+
+	// Step 4: Map back the pages loaded; the others are when their reads are done.
+	for (u_int i = 0; i < n; i++) {
+		if (!loaded[i]) { continue; }
+		swap_map_back(batch[i], bnos[i]);
+		if (i > 0) { batch[i]->pp_flags |= PG_READAHEAD; }
+	}
+	vmstat.swapins += n;
+	vmstat.readaheads += n - 1;
+	vmstat.cyc_swapin += read_cp0_count() - t0;
+
+	// Step 5: Wait for the faulting page.
+	if (wait != NULL) {
+		swap_in_wait(wait, may_block);
+	}
+}
+
+// Point a PTE of a victim at swap block `*(u_int *)pbno`.
+static void pte_swap_out(Pte *pte, u_int asid, u_int va, void *pbno) {
+	u_int sd_bno = *(u_int *)pbno;
+	panic_on(!(*pte & PTE_V));
+	panic_on(*pte & PTE_SWAPPED);
+
+	*pte &= ~PTE_V;  	 		// Unset V.
+	*pte |= PTE_SWAPPED; 		// Set soft-flag SWAPPED.
+	*pte = PTE_FLAGS(*pte); 	// Clear PTE's PAddr field.
+	*pte |= PTE_ADDR(sd_bno << PGSHIFT); // Set addr to sd_bno.
+	rss_add(asid, -1);
+
+	tlb_invalidate(asid, va); // Invalidate corresponding TLB entry.
+}
+
+// Unmap a victim whose data has been written to block `sd_bno`, and free it.
+static void swap_unmap_page(struct Page *pp, u_int sd_bno) {
+	// Refresh the PTE of all VPage mapping the swapped PPage and flush all TLB entries.
+	SwapTableEntry *ste = page2ste(pp);
+	pp->pp_ref -= rmap_walk(pp, pte_swap_out, &sd_bno);
+	if (pp->pp_ref != 0) {
+		panic("page %d: %d mappings left after swap-out", page2ppn(pp), pp->pp_ref);
+	}
+
+	vmstat.swapouts++;
+
+	// Move the reverse map from swap_tbl to bno_tbl, with the policy state of the page.
+	ste_move(bno2ste(sd_bno), ste);
+	bno2ste(sd_bno)->pp_age = pp->pp_age;
+
+	// Free the PPage.
+	page_free(pp);
+}
+
+static void pte_count_writable(Pte *pte, u_int asid, u_int va, void *pn) {
+	if (*pte & PTE_D) { (*(u_int *)pn)++; }
+}
+
+static void pte_to_zero(Pte *pte, u_int asid, u_int va, void *arg) {
+	*pte = (PTE_FLAGS(*pte) & ~PTE_REFTRAP) | page2pa(zero_page);
+	zero_page->pp_ref++;
+	rss_add(asid, -1); // The mapping is no longer registered.
+	tlb_invalidate(asid, va);
+}
+
+// Whether an all-zero victim may be replaced by the zero page: a store through a mapping
+// breaks it away from the zero page alone, so writable mappings must not be shared.
+static int swap_zero_ok(struct Page *pp) {
+	u_int nwritable = 0;
+	if (pp->pp_ref > 1) {
+		rmap_walk(pp, pte_count_writable, &nwritable);
+	}
+	return nwritable == 0 && page_is_zero(pp);
+}
+
+// Evict an all-zero victim by moving its mappings to the zero page, and free it.
+static void swap_zero_out(struct Page *pp) {
+	pp->pp_ref -= rmap_walk(pp, pte_to_zero, NULL);
+	panic_on(pp->pp_ref != 0);
+	ste_clear(page2ste(pp));
+	vmstat.zero_dedups++;
+
+	page_free(pp);
+}
+
+/* Swap out the `nbatch` victims in `batch`, taken off the policy, and return the
+ * number of pages freed.
+ *
+ * The batch is given runs of contiguous swap blocks, so that a whole run is
+ * written by one disk command (see write_pages), before the PTEs and reverse
+ * maps of the batch are rewritten.
+ */
+static int swap_out_batch(struct Page **batch, int nbatch) {
+	// Step 1: Victims needing no write: a clean refetchable page is dropped, a
+	// clean page with a copy in swap (see swap_map_back) only has its mappings
+	// pointed back at that copy, and an all-zero page has them moved to the zero
+	// page. A page table still mapping
+	// resident pages goes back to the policy, and an empty one is freed.
+	int ndirty = 0, nbusy = 0;
+	for (int i = 0; i < nbatch; i++) {
+		struct Page *pp = batch[i];
+		if (pp->pp_flags & PG_READAHEAD) { // Read ahead, but never used.
+			swap_ra_miss(pp);
+		}
+		if (pp->pp_flags & PG_PGTABLE) {
+			int r = pgtable_scan(pp);
+			if (r < 0) {
+				swap_policy->insert(pp);
+				nbusy++;
+			} else if (r == 0) {
+				page_drop(pp);
+			} else {
+				batch[ndirty++] = pp;
+				vmstat.pt_swapouts++;
+			}
+		} else if (refetch_ok(pp)) {
+			swap_cache_drop(pp);
+			page_drop(pp);
+			vmstat.refetch_drops++;
+		} else if (pp->pp_flags & PG_SWAPCACHE) {
+			swap_unmap_page(pp, swap_cache_take(pp));
+		} else if (swap_zero_ok(pp)) {
+			swap_zero_out(pp);
+		} else {
+			batch[ndirty++] = pp;
+		}
+	}
+	if (sd_nfree < ndirty) { swap_cache_shrink(ndirty); }
+
+	// Step 2: Reserve block runs for the rest of the batch. Pages that compress
+	// well go to the compressed pool, and the others are written, one command per
+	// run of them.
+	for (int i = 0; i < ndirty;) {
+		u_int sd_bno, len;
+		len = sd_block_alloc_run(ndirty - i, &sd_bno);
+
+		for (u_int j = 0; j < len;) {
+			u_int k = j;
+			while (k < len && zswap_store(batch[i + k], sd_bno + k) != 0) {
+				k++;
+			}
+			if (k > j) { write_pages(batch + i + j, sd_bno + j, k - j); }
+			if (k < len) { k++; } // Page k is in the pool.
+
+			// Step 3: Rewrite the mappings of the pages stored and free them,
+			// which also makes room for the pool to grow.
+			for (; j < k; j++) {
+				swap_unmap_page(batch[i + j], sd_bno + j);
+			}
+		}
+		i += len;
+	}
+	return nbatch - nbusy;
+}
+
+/* Resident set limits
+ *
+ * 'env_rss' counts the registered mappings of an env to resident pages. An env
+ * can be given a resident limit (see sys_set_rss_limit). Over a soft limit, its
+ * own pages are the first victims when memory runs short; over a hard limit,
+ * each of its faults also evicts its own pages until it is back within the
+ * limit. Its pages are found by a clock hand sweeping its address space
+ * ('env_rss_hand'), which gives referenced pages a second chance.
+ */
+struct Env_list env_rss_list; // Envs with a resident limit.
+
+/* Swap out up to `n` pages mapped by `e`, but not the one at `keep_va`, and
+ * return the number of pages freed. Pages shared with other envs are taken too.
+ */
+static int swap_out_env(struct Env *e, int n, u_long keep_va) {
+	struct Page *batch[SWAP_CLUSTER];
+	int nbatch = 0, nfreed = 0;
+	u_long va = e->env_rss_hand;
+	Pte *kpte = pgdir_peek(e->env_pgdir, keep_va);
+	struct Page *keep = (kpte != NULL && (*kpte & PTE_V)) ? pa2page(*kpte) : NULL;
+
+	// Two rounds at most: the first may only clear reference bits.
+	for (u_int nscan = 0; nscan < 2 * (USTACKTOP - UTEMP) / PAGE_SIZE && nfreed < n; nscan++) {
+		Pte *pte = pgdir_peek(e->env_pgdir, va);
+		if (pte == NULL) { // No resident page table: skip it.
+			u_long next = ROUND(va + 1, PDMAP);
+			nscan += (next - va) / PAGE_SIZE - 1;
+			va = next;
+		} else {
+			struct Page *pp = (*pte & PTE_V) ? pa2page(*pte) : NULL;
+			if (pp != NULL && pp != keep && pp->swap_link.tqe_prev != NULL
+					&& !(pp->pp_flags & (PG_PINNED | PG_PGTABLE))) {
+				vmstat.scanned++;
+				if (pp->accessed) {
+					swap_clear_ref(pp);
+				} else {
+					swap_policy->remove(pp);
+					batch[nbatch++] = pp;
+				}
+			}
+			va += PAGE_SIZE;
+		}
+		if (va >= USTACKTOP - PAGE_SIZE) { va = UTEMP; }
+
+		if (nbatch == SWAP_CLUSTER || (nbatch > 0 && nfreed + nbatch == n)) {
+			nfreed += swap_out_batch(batch, nbatch);
+			nbatch = 0;
+		}
+	}
+	if (nbatch > 0) {
+		nfreed += swap_out_batch(batch, nbatch);
+	}
+	e->env_rss_hand = va;
+	vmstat.rss_evictions += nfreed;
+	return nfreed;
+}
+
+// Keep `e` within its hard resident limit after a fault on `va`.
+void swap_rss_check(struct Env *e, u_long va) {
+	if (e->env_rss_limit != 0 && e->env_rss_hard && e->env_rss > e->env_rss_limit) {
+		u_int t0 = read_cp0_count();
+		swap_out_env(e, e->env_rss - e->env_rss_limit, va);
+		vmstat.cyc_swapout += read_cp0_count() - t0;
+	}
+}
+
+/* Swap out up to `n` pages, and return the number of pages freed.
+ *
+ * Envs deactivated by load control, then envs over their resident limit give
+ * up their own pages first. The rest of the victims are picked by the policy,
+ * SWAP_CLUSTER at a time.
+ */
+int swap_out(int n) {
+	struct Page *batch[SWAP_CLUSTER];
+	struct Env *e;
+	int nfreed = 0;
+	u_int nskip = 0;
+	u_int t0 = read_cp0_count();
+
+#if !defined(LAB) || LAB >= 3
+	// Envs deactivated by load control give up their frames first.
+	TAILQ_FOREACH(e, &env_inactive_list, env_inactive_link) {
+		if (nfreed >= n) { break; }
+		nfreed += swap_out_env(e, n - nfreed, 0);
+	}
+#endif
+	LIST_FOREACH(e, &env_rss_list, env_rss_link) {
+		if (nfreed >= n) { break; }
+		if (e->env_rss > e->env_rss_limit) {
+			nfreed += swap_out_env(e, MIN((u_int)(n - nfreed), e->env_rss - e->env_rss_limit), 0);
+		}
+	}
+
+	while (nfreed < n) {
+		int nbatch = 0;
+		while (nbatch < SWAP_CLUSTER && nfreed + nbatch < n) {
+			struct Page *pp = swap_policy->pick();
+			if (pp == NULL) { break; }
+			batch[nbatch++] = pp;
+		}
+		if (nbatch == 0) { break; }
+
+		int nout = swap_out_batch(batch, nbatch);
+		nfreed += nout;
+		// Only page tables in use were found: give up once the policy has gone round.
+		if (nout == 0 && (nskip += nbatch) > npage) { break; }
+	}
+	//printk("end swap\n");
+	vmstat.cyc_swapout += read_cp0_count() - t0;
+	return nfreed;
+}
+
+/* Page-out daemon, run on every timer interrupt before scheduling.
+ *
+ * It wakes up when fewer than SWAP_WMARK_LOW pages are free, and swaps out up
+ * to SWAPD_BATCH pages per tick until SWAP_WMARK_HIGH pages are free, so that
+ * page_alloc rarely finds no free page and has to reclaim directly.
+ * Timer interrupts are only taken in user mode, so the daemon never runs in
+ * the middle of kernel code.
+ */
+void swapd_tick(void) {
+	static int awake = 0;
+
+	vmstat.ticks++;
+
+	if (page_nfree < SWAP_WMARK_LOW) {
+		awake = 1;
+	}
+	if (!awake) { return; }
+
+	u_int n = SWAP_WMARK_HIGH > page_nfree ? SWAP_WMARK_HIGH - page_nfree : 0;
+	if (n > SWAPD_BATCH) { n = SWAPD_BATCH; }
+	if (n == 0 || swap_out(n) == 0) { // Reached the high watermark, or nothing to swap.
+		awake = 0;
+	}
+}
+
+void _print_sinfo(struct SwapInfo *sinfo) {
+	if (!sinfo) {
+		printk("SwapInfo: null\n"); 
+		return;
+	}
+
+	Pte *pte = sinfo2pte(sinfo);
+	printk(
+			"SwapInfo:\t"
+			"vaddr=%x  "
+			"pgdir=%x  "
+			"pte=%x\n"
+			, sinfo->va, sinfo->pgdir, *pte
+		  );
+}
+
+
+/* sdisk.c
+ * Operations on swapping disk.
+ * This is a CPU friendly PIO SWAP driver.
+ */
+
+/* Swap devices.
+ *
+ * Swap lives on the drives of the secondary IDE channel, which only the kernel
+ * uses. At boot, sd_probe sizes each of them with IDENTIFY DEVICE and gives it
+ * a range of block numbers, starting on a word of `sd_bitmap`. Blocks are taken
+ * from the drives of the highest priority with free blocks, in turn among
+ * drives of equal priority, so that their load is striped.
+ */
+struct sd_dev sd_devs[SD_NDEV] = {
+    {.drive = 0, .prio = SD_PRIO_MASTER},
+    {.drive = 1, .prio = SD_PRIO_SLAVE},
+};
+u_int sd_nblk;	     // Block numbers spanned by the devices, gaps included.
+u_int sd_total;	     // Blocks on the devices.
+static u_int sd_stripe; // Device to look at first for the next allocation.
+
+// The device holding block `bno`, or NULL for a gap between devices.
+static struct sd_dev *bno2dev(u_int bno) {
+	for (int i = 0; i < SD_NDEV; i++) {
+		if (bno - sd_devs[i].start < sd_devs[i].nblk) {
+			return &sd_devs[i];
+		}
+	}
+	return NULL;
+}
+
+/* Swap slot allocator.
+ *
+ * `sd_bitmap` has a bit per block, set while the block is in use. On top of it,
+ * `sd_summary` has a bit per word of `sd_bitmap`, set while that word is full,
+ * so that a search skips 32 * 32 used blocks for each full summary word.
+ * Searches in a device start at its `cursor` (next-fit) and wrap around the
+ * device, instead of rescanning its busy front from the start on every call.
+ * The bits of the gaps between devices are always set.
+ */
+#define SD_NSUM ((MAX(sd_nword, 1u) + 31) / 32)
+
+static u_int sd_nword;	  // Words of sd_bitmap.
+static u_int *sd_bitmap;  // Bits unset on free.
+static u_int *sd_summary; // Bits set on full words of sd_bitmap.
+u_int sd_nfree;		  // Number of free blocks.
+
+// Index of the first zero bit in `w`, which must not be full.
+static inline u_int sd_ffz(u_int w) {
+	return __builtin_ctz(~w);
+}
+
+static inline void sd_block_mark(u_int bno) {
+	u_int w = bno / 32;
+	sd_bitmap[w] |= 1u << (bno % 32);
+	if (sd_bitmap[w] == ~0u) {
+		sd_summary[w / 32] |= 1u << (w % 32);
+	}
+	sd_nfree--;
+	bno2dev(bno)->nfree--;
+}
+
+int sd_block_used(u_int bno) {
+	return (sd_bitmap[bno / 32] >> (bno % 32)) & 1;
+}
+
+// The device to allocate from next: of the highest priority with free blocks, and the first
+// of them after the last one used.
+static struct sd_dev *sd_pick_dev(void) {
+	struct sd_dev *best = NULL;
+	for (u_int k = 0; k < SD_NDEV; k++) {
+		struct sd_dev *d = &sd_devs[(sd_stripe + k) % SD_NDEV];
+		if (d->nfree > 0 && (best == NULL || d->prio > best->prio)) {
+			best = d;
+		}
+	}
+	if (best == NULL) { panic("swap disk out of space"); }
+	sd_stripe = best - sd_devs + 1;
+	return best;
+}
+
+// First and past-the-last words of sd_bitmap covering device `d`.
+static inline u_int sd_dev_w0(struct sd_dev *d) {
+	return d->start / 32;
+}
+
+static inline u_int sd_dev_nword(struct sd_dev *d) {
+	return ROUND(d->nblk, 32) / 32;
+}
+
+// Return the first word of `d` at or after `w` (wrapping around) with a free block, or -1.
+static int sd_next_free_word(struct sd_dev *d, u_int w) {
+	u_int w0 = sd_dev_w0(d), nw = sd_dev_nword(d);
+	for (u_int k = 0; k < nw;) {
+		u_int i = w0 + (w - w0 + k) % nw;
+		if (i % 32 == 0 && sd_summary[i / 32] == ~0u) {
+			k += MIN(32u, w0 + nw - i);
+			continue;
+		}
+		if (sd_bitmap[i] != ~0u) {
+			return i;
+		}
+		k++;
+	}
+	return -1;
+}
+
+int sd_block_alloc() {
+	struct sd_dev *d = sd_pick_dev();
+	int w = sd_next_free_word(d, d->cursor);
+	panic_on(w < 0);
+
+	u_int bno = w * 32 + sd_ffz(sd_bitmap[w]);
+	sd_block_mark(bno);
+	d->cursor = w;
+	return bno;
+}
+
+/* Allocate a run of at most `n` contiguous free blocks, store its first block
+ * number in `*pbno` and return its length (at least 1).
+ * Runs are on a single device. The first run of `n` blocks found from its
+ * cursor is taken; if the device has none, the longest shorter run seen is
+ * taken instead.
+ */
+u_int sd_block_alloc_run(u_int n, u_int *pbno) {
+	struct sd_dev *d = sd_pick_dev();
+	u_int w0 = sd_dev_w0(d), nw = sd_dev_nword(d);
+	int w = sd_next_free_word(d, d->cursor);
+	panic_on(w < 0);
+
+	u_int start = 0, len = 0, best = 0, best_len = 0;
+	for (u_int k = 0; k < nw && best_len < n; k++) {
+		u_int i = w0 + (w - w0 + k) % nw;
+		u_int word = sd_bitmap[i];
+		if (i == w0) { len = 0; } // Runs don't wrap around the end of the device.
+
+		if (i % 32 == 0 && sd_summary[i / 32] == ~0u) {
+			len = 0;
+			k += MIN(32u, w0 + nw - i) - 1;
+		} else if (word == ~0u) {
+			len = 0;
+		} else if (word == 0) {
+			if (len == 0) { start = i * 32; }
+			len += 32;
+		} else {
+			for (u_int b = 0; b < 32 && len < n; b++) {
+				if (word & (1u << b)) {
+					len = 0;
+					continue;
+				}
+				if (len == 0) { start = i * 32 + b; }
+				if (++len > best_len) {
+					best = start;
+					best_len = len;
+				}
+			}
+		}
+		if (len > best_len) {
+			best = start;
+			best_len = MIN(len, n);
+		}
+	}
+
+	for (u_int bno = best; bno < best + best_len; bno++) {
+		sd_block_mark(bno);
+	}
+	d->cursor = (best + best_len) / 32;
+	if (d->cursor >= w0 + nw) { d->cursor = w0; }
+	*pbno = best;
+	return best_len;
+}
+
+void sd_block_free(u_int bno) {
+	struct sd_dev *d = bno < sd_nblk ? bno2dev(bno) : NULL;
+	panic_on(d == NULL || !sd_block_used(bno));
+	u_int w = bno / 32;
+	sd_bitmap[w] &= ~(1u << (bno % 32));
+	sd_summary[w / 32] &= ~(1u << (w % 32));
+	sd_nfree++;
+	d->nfree++;
+	zswap_invalidate(bno);
+}
+
+void sd_bitmap_init() {
+	// Set all bits, then clear those of the device blocks.
+	for (u_int i = 0; i < sd_nword; i++) {
+		sd_bitmap[i] = ~0u;
+	}
+	for (u_int i = 0; i < SD_NSUM; i++) {
+		sd_summary[i] = ~0u;
+	}
+	for (int i = 0; i < SD_NDEV; i++) {
+		struct sd_dev *d = &sd_devs[i];
+		for (u_int bno = d->start; bno < d->start + d->nblk; bno++) {
+			sd_bitmap[bno / 32] &= ~(1u << (bno % 32));
+		}
+		for (u_int w = sd_dev_w0(d); w < sd_dev_w0(d) + sd_dev_nword(d); w++) {
+			sd_summary[w / 32] &= ~(1u << (w % 32));
+		}
+		d->nfree = d->nblk;
+		d->cursor = sd_dev_w0(d);
+	}
+	sd_stripe = 0;
+	sd_nfree = sd_total;
+}
+
+static int read_sd(u_int va, u_int pa, u_int len) {
+	// Check length, only byte, half-word and word.
+	if (len != 1 && len != 2 && len != 4) { return -E_INVAL; }
+	// Check pa.
+	int valid_pa = 0;
+	valid_pa |= (0x18000170 <= pa && pa + len <= 0x18000170 + 0x8) ? 1 : 0; // swap disk
+	if (valid_pa == 0) { return -E_INVAL; };
+
+	// Perform read and return.
+	memcpy((void*)va, (void*)(KSEG1 + pa), (size_t)len);
+	return 0;
 }
 
 static int write_sd(u_int va, u_int pa, u_int len) {
@@ -869,7 +2141,8 @@ static int write_sd(u_int va, u_int pa, u_int len) {
 	return 0;
 }
 
-// TODO hard polling!
+// Busy-wait for BUSY to drop. Only synchronous transfers wait here; swap-in reads are driven
+// by the interrupt (see sd_intr).
 static uint8_t wait_sd_ready() {
 	uint8_t flag;
 	while (1) {
@@ -881,102 +2154,416 @@ static uint8_t wait_sd_ready() {
 	return flag;
 }
 
+// Wait until the device asks for (or offers) the next sector of data.
+static void wait_sd_drq() {
+	uint8_t flag = wait_sd_ready();
+	if (flag & MALTA_SWAP_ERROR) {
+		panic("swap disk error, status %x", flag);
+	}
+	panic_on((flag & MALTA_SWAP_DRQ) == 0);
+}
+
+/* Program the task file for a transfer of `nsecs` (at most SD_MAX_NSECT) sectors
+ * starting at `secno` and issue `cmd`.
+ * The sectors are then streamed through the DATA register one by one, with only
+ * a DRQ wait in between, instead of setting up a new command for each of them.
+ */
+static void sd_command(u_int drive, u_int secno, u_int nsecs, uint8_t cmd) {
+	uint8_t temp;
+	panic_on(nsecs == 0 || nsecs > SD_MAX_NSECT);
+
+	wait_sd_ready();
+	// Step 1: Write the number of operating sectors to NSECT register (0 for 256)
+	temp = nsecs & 0xff;
+	panic_on(write_sd(&temp, MALTA_SWAP_NSECT, 1));
+	// Step 2: Write the 7:0 bits of sector number to LBAL register
+	temp = secno & 0xff;
+	panic_on(write_sd(&temp, MALTA_SWAP_LBAL, 1));
+	// Step 3: Write the 15:8 bits of sector number to LBAM register
+	temp = (secno >> 8) & 0xff;
+	panic_on(write_sd(&temp, MALTA_SWAP_LBAM, 1));
+	// Step 4: Write the 23:16 bits of sector number to LBAH register
+	temp = (secno >> 16) & 0xff;
+	panic_on(write_sd(&temp, MALTA_SWAP_LBAH, 1));
+	// Step 5: Write the 27:24 bits of sector number, addressing mode
+	// and drive to DEVICE register
+	temp = ((secno >> 24) & 0x0f) | MALTA_SWAP_LBA | (drive << 4);
+	panic_on(write_sd(&temp, MALTA_SWAP_DEVICE, 1));
+	// Step 6: Write the working mode to STATUS register
+	panic_on(write_sd(&cmd, MALTA_SWAP_STATUS, 1));
+}
+
+static void sd_sect_in(void *dst) {
+	uint32_t *p = dst;
+	wait_sd_drq();
+	for (int i = 0; i < SECT_SIZE / 4; i++) {
+		p[i] = ioread32(MALTA_SWAP_DATA);
+	}
+}
+
+static void sd_sect_out(const void *src) {
+	const uint32_t *p = src;
+	wait_sd_drq();
+	for (int i = 0; i < SECT_SIZE / 4; i++) {
+		iowrite32(p[i], MALTA_SWAP_DATA);
+	}
+}
+
+// Length of the first run of the `n` blocks from `bno` that one command can transfer: at most
+// SD_MAX_NSECT / SECT2BLK blocks, on a single device `*pd`.
+static u_int sd_run(u_int bno, u_int n, struct sd_dev **pd) {
+	struct sd_dev *d = bno2dev(bno);
+	panic_on(d == NULL);
+	*pd = d;
+	return MIN(MIN(n, (u_int)(SD_MAX_NSECT / SECT2BLK)), d->start + d->nblk - bno);
+}
+
+/* Interrupt-driven reads.
+ *
+ * Queued requests are issued one at a time. Each sector of the request in
+ * flight raises the swap disk interrupt (IRQ 15, through the i8259s) when it's
+ * ready, and sd_intr moves it, so envs run between sectors instead of the
+ * kernel spinning on BUSY. A finished request goes to the done list, for the
+ * swap code to map its pages back and wake its waiters (see swap_io_complete).
+ *
+ * Synchronous transfers poll the same way for the request in flight to finish,
+ * then hold the queue (`sd_sync`) until they are done.
+ */
+static struct sd_req sd_reqs[SD_NREQ];
+static struct sd_req_tailq sd_req_free_list = TAILQ_HEAD_INITIALIZER(sd_req_free_list);
+static struct sd_req_tailq sd_queue = TAILQ_HEAD_INITIALIZER(sd_queue);
+static struct sd_req_tailq sd_done = TAILQ_HEAD_INITIALIZER(sd_done);
+static struct sd_req *sd_active; // Request in flight, NULL if the channel is idle.
+static int sd_sync;		 // Whether a synchronous transfer holds the channel.
+
+static void sd_i8259_init(void) {
+	// ICW1: edge triggered, cascade, ICW4 follows. ICW2: vector base, unused on MIPS.
+	// ICW3: the slave is on line 2 of the master. ICW4: 8086 mode.
+	iowrite8(0x11, MALTA_I8259_MASTER);
+	iowrite8(0x00, MALTA_I8259_MASTER + 1);
+	iowrite8(0x04, MALTA_I8259_MASTER + 1);
+	iowrite8(0x01, MALTA_I8259_MASTER + 1);
+	iowrite8(0x11, MALTA_I8259_SLAVE);
+	iowrite8(0x08, MALTA_I8259_SLAVE + 1);
+	iowrite8(0x02, MALTA_I8259_SLAVE + 1);
+	iowrite8(0x01, MALTA_I8259_SLAVE + 1);
+	// OCW1: mask all lines but the cascade and the swap disk.
+	iowrite8(~(1u << 2) & 0xff, MALTA_I8259_MASTER + 1);
+	iowrite8(~(1u << (MALTA_SWAP_IRQ - 8)) & 0xff, MALTA_I8259_SLAVE + 1);
+}
+
+void sd_intr_init(void) {
+	for (int i = 0; i < SD_NREQ; i++) {
+		TAILQ_INSERT_TAIL(&sd_req_free_list, &sd_reqs[i], link);
+	}
+	sd_i8259_init();
+	iowrite8(0, MALTA_SWAP_CTRL); // Unmask INTRQ of the drives.
+}
+
+// Issue the next queued request if the channel is free.
+static void sd_kick(void) {
+	struct sd_req *r = TAILQ_FIRST(&sd_queue);
+	if (sd_active != NULL || sd_sync || r == NULL) { return; }
+	TAILQ_REMOVE(&sd_queue, r, link);
+	sd_active = r;
+	struct sd_dev *d = bno2dev(r->bno);
+	sd_command(d->drive, (r->bno - d->start) * SECT2BLK, r->n * SECT2BLK,
+		   MALTA_SWAP_CMD_PIO_READ);
+}
+
+// Move the next sector of the request in flight if the device offers it. Reading STATUS
+// also acknowledges the interrupt of the device, and a stale interrupt finds it BUSY or
+// without DRQ.
+static void sd_poll(void) {
+	struct sd_req *r = sd_active;
+	uint8_t flag;
+
+	panic_on(read_sd(&flag, MALTA_SWAP_STATUS, 1));
+	if (r == NULL || (flag & MALTA_SWAP_BUSY)) { return; }
+	if (flag & MALTA_SWAP_ERROR) {
+		panic("swap disk error, status %x", flag);
+	}
+	if (!(flag & MALTA_SWAP_DRQ)) { return; }
+
+	uint32_t *p = (uint32_t *)(page2kva(r->pps[r->nsect / SECT2BLK])
+				   + r->nsect % SECT2BLK * SECT_SIZE);
+	for (int i = 0; i < SECT_SIZE / 4; i++) {
+		p[i] = ioread32(MALTA_SWAP_DATA);
+	}
+	if (++r->nsect == r->n * SECT2BLK) {
+		r->done = 1;
+		sd_active = NULL;
+		TAILQ_INSERT_TAIL(&sd_done, r, link);
+		sd_kick();
+	}
+}
+
+// The swap disk interrupt handler.
+void sd_intr(void) {
+	sd_poll();
+	iowrite8(MALTA_I8259_EOI, MALTA_I8259_SLAVE);
+	iowrite8(MALTA_I8259_EOI, MALTA_I8259_MASTER);
+}
+
+// Let the request in flight finish, and hold the queue for a synchronous transfer.
+static void sd_sync_begin(void) {
+	sd_sync = 1;
+	while (sd_active != NULL) {
+		sd_poll();
+	}
+}
+
+static void sd_sync_end(void) {
+	sd_sync = 0;
+	sd_kick();
+}
+
+/* Queue a read of the contiguous blocks [bno, bno + n) into `n` pages, as one
+ * request per command (see sd_run), and return the first request, or NULL if
+ * there are not enough free requests. The pages must stay allocated until the
+ * requests are reaped.
+ */
+struct sd_req *sd_read_async(struct Page **pps, u_int bno, u_int n) {
+	struct sd_req *first = NULL, *r;
+	struct sd_dev *d;
+	u_int nreq = 0;
+
+	for (u_int b = bno; b < bno + n; nreq++) {
+		b += sd_run(b, bno + n - b, &d);
+	}
+	for (r = TAILQ_FIRST(&sd_req_free_list); r != NULL && nreq > 0; r = TAILQ_NEXT(r, link)) {
+		nreq--;
+	}
+	if (nreq > 0) { return NULL; }
+
+	while (n > 0) {
+		r = TAILQ_FIRST(&sd_req_free_list);
+		TAILQ_REMOVE(&sd_req_free_list, r, link);
+		r->bno = bno;
+		r->n = sd_run(bno, n, &d);
+		for (u_int i = 0; i < r->n; i++) {
+			r->pps[i] = pps[i];
+		}
+		r->nsect = 0;
+		r->done = 0;
+		r->fault = -1;
+		LIST_INIT(&r->waiters);
+		TAILQ_INSERT_TAIL(&sd_queue, r, link);
+		if (first == NULL) { first = r; }
+		pps += r->n;
+		bno += r->n;
+		n -= r->n;
+	}
+	sd_kick();
+	return first;
+}
+
+static struct sd_req *sd_req_lookup(struct sd_req_tailq *q, u_int bno) {
+	struct sd_req *r;
+	TAILQ_FOREACH(r, q, link) {
+		if (bno - r->bno < r->n) { return r; }
+	}
+	return NULL;
+}
+
+// The request reading block `bno` that has not been reaped yet, or NULL.
+struct sd_req *sd_req_find(u_int bno) {
+	struct sd_req *r = sd_active;
+	if (r != NULL && bno - r->bno < r->n) { return r; }
+	if ((r = sd_req_lookup(&sd_queue, bno)) != NULL) { return r; }
+	return sd_req_lookup(&sd_done, bno);
+}
+
+// Poll until request `r` is done, zeroing free pages meanwhile.
+void sd_wait(struct sd_req *r) {
+	while (!r->done) {
+		sd_kick();
+		sd_poll();
+		if (!r->done) {
+			page_prezero(1);
+		}
+	}
+}
+
+// Poll until some request is done, zeroing free pages meanwhile, and return 0 if none is
+// queued or done.
+int sd_wait_any(void) {
+	if (sd_active == NULL && TAILQ_EMPTY(&sd_queue) && TAILQ_EMPTY(&sd_done)) { return 0; }
+	while (TAILQ_EMPTY(&sd_done)) {
+		sd_kick();
+		sd_poll();
+		if (TAILQ_EMPTY(&sd_done)) {
+			page_prezero(1);
+		}
+	}
+	return 1;
+}
+
+// Take a done request off the done list, NULL if there is none.
+struct sd_req *sd_reap(void) {
+	struct sd_req *r = TAILQ_FIRST(&sd_done);
+	if (r != NULL) {
+		TAILQ_REMOVE(&sd_done, r, link);
+	}
+	return r;
+}
+
+void sd_req_free(struct sd_req *r) {
+	panic_on(!LIST_EMPTY(&r->waiters));
+	TAILQ_INSERT_HEAD(&sd_req_free_list, r, link);
+}
+
+// Identify `drive` and return its size in blocks, or 0 if it's absent.
+static u_int sd_identify(u_int drive) {
+	u_int id[SECT_SIZE / 4];
+	uint8_t temp, flag;
+
+	temp = MALTA_SWAP_LBA | (drive << 4);
+	panic_on(write_sd(&temp, MALTA_SWAP_DEVICE, 1));
+	temp = MALTA_SWAP_CMD_IDENTIFY;
+	panic_on(write_sd(&temp, MALTA_SWAP_STATUS, 1));
+	panic_on(read_sd(&flag, MALTA_SWAP_STATUS, 1));
+	if (flag == 0 || flag == 0xff) { // No drive, or no channel.
+		return 0;
+	}
+	if (wait_sd_ready() & MALTA_SWAP_ERROR) { // Not an ATA drive.
+		return 0;
+	}
+	sd_sect_in(id);
+
+	// Words 60-61: the number of sectors addressable in LBA28 mode.
+	u_short *w = (u_short *)id;
+	return (w[60] | (w[61] << 16)) / SECT2BLK;
+}
+
+/* Size the swap devices and lay out their block numbers, and allocate the slot
+ * bitmaps to match. At most SD_MAX_NBLK blocks are used in all.
+ */
+void sd_probe(void) {
+	u_int budget = SD_MAX_NBLK;
+
+	sd_nblk = sd_total = 0;
+	for (int i = 0; i < SD_NDEV; i++) {
+		struct sd_dev *d = &sd_devs[i];
+		d->nblk = MIN(sd_identify(d->drive), budget);
+		d->start = sd_nblk;
+		budget -= d->nblk;
+		sd_total += d->nblk;
+		sd_nblk = ROUND(d->start + d->nblk, 32);
+		if (d->nblk != 0) {
+			printk("swap device %d: %d blocks at %d, priority %d\n", d->drive, d->nblk,
+			       d->start, d->prio);
+		}
+	}
+
+	sd_nword = sd_nblk / 32;
+	sd_bitmap = (u_int *)alloc(MAX(sd_nword, 1u) * sizeof(u_int), sizeof(u_int), 1);
+	sd_summary = (u_int *)alloc(SD_NSUM * sizeof(u_int), sizeof(u_int), 1);
+	sd_intr_init();
+}
+
+// Read `nsecs` sectors from sector `secno` of swap device `diskno` (an index in 'sd_devs').
 void sd_read(u_int diskno, u_int secno, void *dst, u_int nsecs) {
-	uint8_t temp; // Alloc a main mem BUFFER on the stack.
-	// `offset` records the starting offset of the next sector to operate.
-	u_int offset = 0, max = nsecs + secno;
-	panic_on(diskno != 2);
-
-	while (secno < max) {
-		temp = wait_sd_ready();
-		// Step 1: Write the number of operating sectors to NSECT register
-		temp = 1;
-		panic_on(write_sd(&temp, MALTA_SWAP_NSECT, 1));
-		// Step 2: Write the 7:0 bits of sector number to LBAL register
-		temp = secno & 0xff;
-		panic_on(write_sd(&temp, MALTA_SWAP_LBAL, 1));
-		// Step 3: Write the 15:8 bits of sector number to LBAM register
-		temp = (secno >> 8) & 0xff;
-		panic_on(write_sd(&temp, MALTA_SWAP_LBAM, 1));
-		// Step 4: Write the 23:16 bits of sector number to LBAH register
-		temp = (secno >> 16) & 0xff;
-		panic_on(write_sd(&temp, MALTA_SWAP_LBAH, 1));
-		// Step 5: Write the 27:24 bits of sector number, addressing mode
-		// and diskno to DEVICE register
-		temp = ((secno >> 24) & 0x0f) | MALTA_SWAP_LBA | (diskno << 4);
-		panic_on(write_sd(&temp, MALTA_SWAP_DEVICE, 1));
-		// Step 6: Write the working mode to STATUS register
-		temp = MALTA_SWAP_CMD_PIO_READ;
-		panic_on(write_sd(&temp, MALTA_SWAP_STATUS, 1));
-
-		// Step 7: Wait until the SWAP is ready
-		temp = wait_sd_ready();
-		// Step 8: Read the data from device
-		for (int i = 0; i < SECT_SIZE / 4; i++) {
-			panic_on(read_sd(dst + offset + i * 4, MALTA_SWAP_DATA, 4));
-		}
-		// Step 9: Check SWAP status
-		panic_on(read_sd(&temp, MALTA_SWAP_STATUS, 1));
-
-		offset += SECT_SIZE;
-		secno += 1;
+	panic_on(diskno >= SD_NDEV || sd_devs[diskno].nblk == 0);
+
+	sd_sync_begin();
+	while (nsecs > 0) {
+		u_int n = MIN(nsecs, (u_int)SD_MAX_NSECT);
+		sd_command(sd_devs[diskno].drive, secno, n, MALTA_SWAP_CMD_PIO_READ);
+		for (u_int i = 0; i < n; i++) {
+			sd_sect_in(dst);
+			dst += SECT_SIZE;
+		}
+		secno += n;
+		nsecs -= n;
 	}
+	wait_sd_ready();
+	sd_sync_end();
 }
 
+// Write `nsecs` sectors to sector `secno` of swap device `diskno` (an index in 'sd_devs').
 void sd_write(u_int diskno, u_int secno, void *src, u_int nsecs) {
-	uint8_t temp;
-	u_int offset = 0, max = nsecs + secno;
-	panic_on(diskno != 2);
-
-	// Write the sector in turn
-	while (secno < max) {
-		temp = wait_sd_ready();
-		// Step 1: Write the number of operating sectors to NSECT register
-		temp = 1;
-		panic_on(write_sd(&temp, MALTA_SWAP_NSECT, 1));
-		// Step 2: Write the 7:0 bits of sector number to LBAL register
-		temp = secno & 0xff;
-		panic_on(write_sd(&temp, MALTA_SWAP_LBAL, 1));
-		// Step 3: Write the 15:8 bits of sector number to LBAM register
-		temp = (secno >> 8) & 0xff;
-		panic_on(write_sd(&temp, MALTA_SWAP_LBAM, 1));
-		// Step 4: Write the 23:16 bits of sector number to LBAH register
-		temp = (secno >> 16) & 0xff;
-		panic_on(write_sd(&temp, MALTA_SWAP_LBAH, 1));
-		// Step 5: Write the 27:24 bits of sector number, addressing mode
-		// and diskno to DEVICE register
-		temp = ((secno >> 24) & 0x0f) | MALTA_SWAP_LBA | (diskno << 4);
-		panic_on(write_sd(&temp, MALTA_SWAP_DEVICE, 1));
-		// Step 6: Write the working mode to STATUS register
-		temp = MALTA_SWAP_CMD_PIO_WRITE;
-		panic_on(write_sd(&temp, MALTA_SWAP_STATUS, 1));
-		// Step 7: Wait until the SWAP is ready
-		temp = wait_sd_ready();
-		// Step 8: Write the data to device
-		for (int i = 0; i < SECT_SIZE / 4; i++) {
-			/* Exercise 5.3: Your code here. (9/9) */
-			panic_on(write_sd(src + offset + i * 4, MALTA_SWAP_DATA, 4));
-		}
-		// Step 9: Check SWAP status
-		panic_on(read_sd(&temp, MALTA_SWAP_STATUS, 1));
-
-		offset += SECT_SIZE;
-		secno += 1;
+	panic_on(diskno >= SD_NDEV || sd_devs[diskno].nblk == 0);
+
+	sd_sync_begin();
+	while (nsecs > 0) {
+		u_int n = MIN(nsecs, (u_int)SD_MAX_NSECT);
+		sd_command(sd_devs[diskno].drive, secno, n, MALTA_SWAP_CMD_PIO_WRITE);
+		for (u_int i = 0; i < n; i++) {
+			sd_sect_out(src);
+			src += SECT_SIZE;
+		}
+		secno += n;
+		nsecs -= n;
 	}
+	// The last sector is committed once BUSY drops.
+	wait_sd_ready();
+	sd_sync_end();
 }
 
 void write_page(struct Page *pp, u_int bno) {
 	u_long kva = page2kva(pp);
-	sd_write(2, bno * SECT2BLK, kva, SECT2BLK);
+	struct sd_dev *d = bno2dev(bno);
+	panic_on(d == NULL);
+	sd_write(d - sd_devs, (bno - d->start) * SECT2BLK, kva, SECT2BLK);
 	//printk("value 1st byte to bno %x: %x\n", bno, *((int *)kva));
 }
 
 void read_page(struct Page *pp, u_int bno) {
 	u_long kva = page2kva(pp);
-	sd_read(2, bno * SECT2BLK, kva, SECT2BLK);
+	struct sd_dev *d = bno2dev(bno);
+	panic_on(d == NULL);
+	sd_read(d - sd_devs, (bno - d->start) * SECT2BLK, kva, SECT2BLK);
 	//printk("value 1st byte at bno %x: %x\n", bno, *((int *)kva));
 }
 
+/* Write `n` pages to the contiguous blocks [bno, bno + n).
+ * The pages need not be physically contiguous; a single command covers up to
+ * SD_MAX_NSECT / SECT2BLK of them, on one device.
+ */
+void write_pages(struct Page **pps, u_int bno, u_int n) {
+	struct sd_dev *d;
+	sd_sync_begin();
+	while (n > 0) {
+		u_int run = sd_run(bno, n, &d);
+		sd_command(d->drive, (bno - d->start) * SECT2BLK, run * SECT2BLK,
+			   MALTA_SWAP_CMD_PIO_WRITE);
+		for (u_int i = 0; i < run; i++) {
+			u_long kva = page2kva(pps[i]);
+			for (u_int s = 0; s < SECT2BLK; s++) {
+				sd_sect_out((void *)(kva + s * SECT_SIZE));
+			}
+		}
+		pps += run;
+		bno += run;
+		n -= run;
+	}
+	wait_sd_ready();
+	sd_sync_end();
+}
+
+// Read the contiguous blocks [bno, bno + n) into `n` pages.
+void read_pages(struct Page **pps, u_int bno, u_int n) {
+	struct sd_dev *d;
+	sd_sync_begin();
+	while (n > 0) {
+		u_int run = sd_run(bno, n, &d);
+		sd_command(d->drive, (bno - d->start) * SECT2BLK, run * SECT2BLK,
+			   MALTA_SWAP_CMD_PIO_READ);
+		for (u_int i = 0; i < run; i++) {
+			u_long kva = page2kva(pps[i]);
+			for (u_int s = 0; s < SECT2BLK; s++) {
+				sd_sect_in((void *)(kva + s * SECT_SIZE));
+			}
+		}
+		pps += run;
+		bno += run;
+		n -= run;
+	}
+	wait_sd_ready();
+	sd_sync_end();
+}
+
 void test_sdisk() {
 	printk("Testing sdisk...\n");
 	int magic = 0x12345678;
@@ -1011,3 +2598,121 @@ void test_sdisk() {
 	printk("Finish reading the page\n");
 	printk("Test sdisk finished!\n");
 }
+
+/* Microbenchmark of the swap disk driver.
+ * Times `nblk` single-page transfers (write_page/read_page) against the same
+ * blocks moved in clustered runs (write_pages/read_pages), in CP0 Count cycles.
+ * Note that this overwrites the swap disk, so only call it before any env runs.
+ */
+void bench_sdisk(u_int nblk) {
+	struct Page *pps[SD_MAX_NSECT / SECT2BLK];
+	u_int nrun = SD_MAX_NSECT / SECT2BLK;
+	u_int t0, wcyc, rcyc;
+
+	printk("Benchmarking sdisk over %d blocks...\n", nblk);
+	panic_on(nblk > sd_devs[0].nblk); // Blocks [0, nblk) are on the first device.
+	for (u_int i = 0; i < nrun; i++) {
+		panic_on(page_alloc(&pps[i]));
+		*(u_int *)page2kva(pps[i]) = i;
+	}
+
+	t0 = read_cp0_count();
+	for (u_int bno = 0; bno < nblk; bno++) {
+		write_page(pps[bno % nrun], bno);
+	}
+	wcyc = read_cp0_count() - t0;
+	t0 = read_cp0_count();
+	for (u_int bno = 0; bno < nblk; bno++) {
+		read_page(pps[bno % nrun], bno);
+	}
+	rcyc = read_cp0_count() - t0;
+	printk("page:    write %d cycles/blk, read %d cycles/blk\n", wcyc / nblk, rcyc / nblk);
+
+	t0 = read_cp0_count();
+	for (u_int bno = 0; bno < nblk; bno += nrun) {
+		write_pages(pps, bno, MIN(nrun, nblk - bno));
+	}
+	wcyc = read_cp0_count() - t0;
+	t0 = read_cp0_count();
+	for (u_int bno = 0; bno < nblk; bno += nrun) {
+		read_pages(pps, bno, MIN(nrun, nblk - bno));
+	}
+	rcyc = read_cp0_count() - t0;
+	printk("cluster: write %d cycles/blk, read %d cycles/blk\n", wcyc / nblk, rcyc / nblk);
+
+	for (u_int i = 0; i < nrun; i++) {
+		if (*(u_int *)page2kva(pps[i]) != i) {
+			panic("sdisk bench failed, wrong value read");
+		}
+		page_free(pps[i]);
+	}
+	printk("Bench sdisk finished!\n");
+}
+
+/* Self-test of the swap slot allocator.
+ * Blocks are occupied at random to 10%, 50% and 95% of the disk, then the cost
+ * of single-slot and 8-slot run allocations is reported in CP0 Count cycles.
+ * The allocator is reset when done.
+ */
+void test_sd_alloc(void) {
+	static const u_int occupancy[] = {10, 50, 95};
+	u_int held[64], held_len[64];
+	u_int y = 2463534242u;
+	u_int t0, cyc, cyc_run, n, nrun;
+
+	printk("Testing swap slot allocator...\n");
+	for (int k = 0; k < sizeof(occupancy) / sizeof(occupancy[0]); k++) {
+		// Occupy every block, then free random ones until the occupancy is reached.
+		sd_bitmap_init();
+		while (sd_nfree > 0) {
+			sd_block_alloc();
+		}
+		while ((sd_total - sd_nfree) * 100 > sd_total * occupancy[k]) {
+			y ^= y << 13;
+			y ^= y >> 17;
+			y ^= y << 5;
+			u_int bno = y % sd_nblk;
+			if (bno2dev(bno) != NULL && sd_block_used(bno)) {
+				sd_block_free(bno);
+			}
+		}
+
+		// Single slots.
+		n = MIN(64u, sd_nfree);
+		t0 = read_cp0_count();
+		for (u_int i = 0; i < n; i++) {
+			held[i] = sd_block_alloc();
+		}
+		cyc = read_cp0_count() - t0;
+		for (u_int i = 0; i < n; i++) {
+			panic_on(held[i] >= sd_nblk || !sd_block_used(held[i]));
+			sd_block_free(held[i]);
+		}
+
+		// Runs for clustered I/O.
+		u_int nfree = sd_nfree;
+		nrun = MIN(64u, sd_nfree / 8);
+		t0 = read_cp0_count();
+		for (u_int i = 0; i < nrun; i++) {
+			held_len[i] = sd_block_alloc_run(8, &held[i]);
+		}
+		cyc_run = read_cp0_count() - t0;
+		for (u_int i = 0; i < nrun; i++) {
+			for (u_int bno = held[i]; bno < held[i] + held_len[i]; bno++) {
+				panic_on(!sd_block_used(bno));
+				nfree--;
+			}
+		}
+		panic_on(nfree != sd_nfree);
+		for (u_int i = 0; i < nrun; i++) {
+			for (u_int bno = held[i]; bno < held[i] + held_len[i]; bno++) {
+				sd_block_free(bno);
+			}
+		}
+
+		printk("occupancy %d%%: alloc %d cycles/slot, alloc_run(8) %d cycles/run\n",
+		       occupancy[k], n ? cyc / n : 0, nrun ? cyc_run / nrun : 0);
+	}
+	sd_bitmap_init();
+	printk("Test swap slot allocator finished!\n");
+}
@@ -1,6 +1,86 @@
 #include <env.h>
 #include <pmap.h>
 #include <printk.h>
+#include <sched.h>
+#include <swap.h>
+
+extern struct Env envs[];
+
+/* Load control
+ *
+ * When the working sets of the runnable envs don't fit in memory, every time
+ * slice is spent faulting pages back in that the others will evict again. Load
+ * control counts the major faults of each env in windows of LOADCTL_WINDOW
+ * ticks. Over LOADCTL_THRASH faults in a window, the env faulting most is
+ * deactivated: 'schedule' passes it over, and 'swap_out' takes its pages first,
+ * so its frames go to the others. Once the faults drop below LOADCTL_CALM, or
+ * it has been out for LOADCTL_MAX_OUT windows, the oldest deactivated env is let
+ * back in, one per window; if memory is still short, another one goes out.
+ */
+static u_int loadctl_window; // windows since boot
+
+static void deactivate(struct Env *e) {
+	e->env_inactive = 1;
+	e->env_inactive_since = loadctl_window;
+	TAILQ_INSERT_TAIL(&env_inactive_list, e, env_inactive_link);
+	vmstat.deactivations++;
+}
+
+static void reactivate(struct Env *e) {
+	e->env_inactive = 0;
+	TAILQ_REMOVE(&env_inactive_list, e, env_inactive_link);
+	vmstat.reactivations++;
+}
+
+// Called on every timer interrupt.
+void loadctl_tick(void) {
+	static u_int ticks = 0;
+	if (++ticks < LOADCTL_WINDOW) {
+		return;
+	}
+	ticks = 0;
+	loadctl_window++;
+
+	// Count the faults in this window, and find the active env faulting most.
+	struct Env *victim = NULL;
+	u_int nfault = 0, nvictim = 0, nactive = 0;
+	for (u_int i = 0; i < NENV; i++) {
+		struct Env *e = &envs[i];
+		if (e->env_status == ENV_FREE) {
+			continue;
+		}
+		nfault += e->env_majflt;
+		if (e->env_status == ENV_RUNNABLE && !e->env_inactive) {
+			nactive++;
+			if (e->env_majflt > nvictim) {
+				victim = e;
+				nvictim = e->env_majflt;
+			}
+		}
+		e->env_majflt = 0;
+	}
+
+	struct Env *oldest = TAILQ_FIRST(&env_inactive_list);
+	if (oldest != NULL && (nfault < LOADCTL_CALM ||
+			       loadctl_window - oldest->env_inactive_since >= LOADCTL_MAX_OUT)) {
+		reactivate(oldest);
+	}
+	// Keep one env running at least: deactivating the last would only idle the CPU.
+	if (nfault > LOADCTL_THRASH && victim != NULL && nactive > 1) {
+		deactivate(victim);
+	}
+}
+
+// The first runnable env not deactivated by load control, NULL if none.
+static struct Env *pick_active(void) {
+	struct Env *e;
+	TAILQ_FOREACH(e, &env_sched_list, env_sched_link) {
+		if (!e->env_inactive) {
+			return e;
+		}
+	}
+	return NULL;
+}
 
 /* Overview:
  *   Implement a round-robin scheduling to select a runnable env and schedule it using 'env_run'.
@@ -34,13 +114,9 @@ void schedule(int yield) {
 	 *   'TAILQ_FIRST', 'TAILQ_REMOVE', 'TAILQ_INSERT_TAIL'
 	 */
 	/* Exercise 3.12: Your code here. */
-	if (yield != 0 || count == 0 || e == NULL || e->env_status != ENV_RUNNABLE)
+	if (yield != 0 || count == 0 || e == NULL || e->env_status != ENV_RUNNABLE ||
+	    e->env_inactive)
 	{
-		if (e == NULL && TAILQ_EMPTY(&env_sched_list))
-		{
-			panic("no runnable env");
-		}
-
 		if (e != NULL)
 		{
 			TAILQ_REMOVE(&env_sched_list, e, env_sched_link);
@@ -50,7 +126,21 @@ void schedule(int yield) {
 			}
 		}
 
-		e = TAILQ_FIRST(&env_sched_list);
+		// Wake up the envs whose swap-in reads are done, and if none can run, wait for
+		// the reads in flight. Deactivated envs only run when no other env can.
+		swap_io_complete();
+		while ((e = pick_active()) == NULL && swap_io_wait())
+		{
+		}
+		if (e == NULL)
+		{
+			e = TAILQ_FIRST(&env_sched_list);
+		}
+		if (e == NULL)
+		{
+			panic("no runnable env");
+		}
+
 		count = e->env_pri - 1;
 		env_run(e);
 	}
@@ -7,6 +7,7 @@
 #include <malta.h>
 #include <mmu.h>
 #include <pmap.h>
+#include <io.h>
 
 int sd_bitmap[SD_NBLK / 32 + 1]; // Bits unset on free.
 
@@ -72,89 +73,92 @@ static uint8_t wait_sd_ready() {
 	return flag;
 }
 
+// Wait until the device asks for (or offers) the next sector of data.
+static void wait_sd_drq() {
+	uint8_t flag = wait_sd_ready();
+	if (flag & MALTA_SWAP_ERROR) {
+		panic("swap disk error, status %x", flag);
+	}
+	panic_on((flag & MALTA_SWAP_DRQ) == 0);
+}
+
+/* Program the task file for a transfer of `nsecs` (at most SD_MAX_NSECT) sectors
+ * starting at `secno` and issue `cmd`.
+ * The sectors are then streamed through the DATA register one by one, with only
+ * a DRQ wait in between, instead of setting up a new command for each of them.
+ */
+static void sd_command(u_int diskno, u_int secno, u_int nsecs, uint8_t cmd) {
+	uint8_t temp;
+	panic_on(nsecs == 0 || nsecs > SD_MAX_NSECT);
+
+	wait_sd_ready();
+	// Step 1: Write the number of operating sectors to NSECT register (0 for 256)
+	temp = nsecs & 0xff;
+	panic_on(write_sd(&temp, MALTA_SWAP_NSECT, 1));
+	// Step 2: Write the 7:0 bits of sector number to LBAL register
+	temp = secno & 0xff;
+	panic_on(write_sd(&temp, MALTA_SWAP_LBAL, 1));
+	// Step 3: Write the 15:8 bits of sector number to LBAM register
+	temp = (secno >> 8) & 0xff;
+	panic_on(write_sd(&temp, MALTA_SWAP_LBAM, 1));
+	// Step 4: Write the 23:16 bits of sector number to LBAH register
+	temp = (secno >> 16) & 0xff;
+	panic_on(write_sd(&temp, MALTA_SWAP_LBAH, 1));
+	// Step 5: Write the 27:24 bits of sector number, addressing mode
+	// and diskno to DEVICE register
+	temp = ((secno >> 24) & 0x0f) | MALTA_SWAP_LBA | (diskno << 4);
+	panic_on(write_sd(&temp, MALTA_SWAP_DEVICE, 1));
+	// Step 6: Write the working mode to STATUS register
+	panic_on(write_sd(&cmd, MALTA_SWAP_STATUS, 1));
+}
+
+static void sd_sect_in(void *dst) {
+	uint32_t *p = dst;
+	wait_sd_drq();
+	for (int i = 0; i < SECT_SIZE / 4; i++) {
+		p[i] = ioread32(MALTA_SWAP_DATA);
+	}
+}
+
+static void sd_sect_out(const void *src) {
+	const uint32_t *p = src;
+	wait_sd_drq();
+	for (int i = 0; i < SECT_SIZE / 4; i++) {
+		iowrite32(p[i], MALTA_SWAP_DATA);
+	}
+}
 
 void sd_read(u_int diskno, u_int secno, void *dst, u_int nsecs) {
-	uint8_t temp; // Alloc a main mem BUFFER on the stack.
-	// `offset` records the starting offset of the next sector to operate.
-	u_int offset = 0, max = nsecs + secno;
 	panic_on(diskno != 2);
 
-	while (secno < max) {
-		temp = wait_sd_ready();
-		// Step 1: Write the number of operating sectors to NSECT register
-		temp = 1;
-		panic_on(write_sd(&temp, MALTA_SWAP_NSECT, 1));
-		// Step 2: Write the 7:0 bits of sector number to LBAL register
-		temp = secno & 0xff;
-		panic_on(write_sd(&temp, MALTA_SWAP_LBAL, 1));
-		// Step 3: Write the 15:8 bits of sector number to LBAM register
-		temp = (secno >> 8) & 0xff;
-		panic_on(write_sd(&temp, MALTA_SWAP_LBAM, 1));
-		// Step 4: Write the 23:16 bits of sector number to LBAH register
-		temp = (secno >> 16) & 0xff;
-		panic_on(write_sd(&temp, MALTA_SWAP_LBAH, 1));
-		// Step 5: Write the 27:24 bits of sector number, addressing mode
-		// and diskno to DEVICE register
-		temp = ((secno >> 24) & 0x0f) | MALTA_SWAP_LBA | (diskno << 4);
-		panic_on(write_sd(&temp, MALTA_SWAP_DEVICE, 1));
-		// Step 6: Write the working mode to STATUS register
-		temp = MALTA_SWAP_CMD_PIO_READ;
-		panic_on(write_sd(&temp, MALTA_SWAP_STATUS, 1));
-
-		// Step 7: Wait until the SWAP is ready
-		temp = wait_sd_ready();
-		// Step 8: Read the data from device
-		for (int i = 0; i < SECT_SIZE / 4; i++) {
-			panic_on(read_sd(dst + offset + i * 4, MALTA_SWAP_DATA, 4));
+	while (nsecs > 0) {
+		u_int n = MIN(nsecs, (u_int)SD_MAX_NSECT);
+		sd_command(diskno, secno, n, MALTA_SWAP_CMD_PIO_READ);
+		for (u_int i = 0; i < n; i++) {
+			sd_sect_in(dst);
+			dst += SECT_SIZE;
 		}
-		// Step 9: Check SWAP status
-		panic_on(read_sd(&temp, MALTA_SWAP_STATUS, 1));
-
-		offset += SECT_SIZE;
-		secno += 1;
+		secno += n;
+		nsecs -= n;
 	}
+	wait_sd_ready();
 }
 
 void sd_write(u_int diskno, u_int secno, void *src, u_int nsecs) {
-	uint8_t temp;
-	u_int offset = 0, max = nsecs + secno;
 	panic_on(diskno != 2);
 
-	// Write the sector in turn
-	while (secno < max) {
-		temp = wait_sd_ready();
-		// Step 1: Write the number of operating sectors to NSECT register
-		temp = 1;
-		panic_on(write_sd(&temp, MALTA_SWAP_NSECT, 1));
-		// Step 2: Write the 7:0 bits of sector number to LBAL register
-		temp = secno & 0xff;
-		panic_on(write_sd(&temp, MALTA_SWAP_LBAL, 1));
-		// Step 3: Write the 15:8 bits of sector number to LBAM register
-		temp = (secno >> 8) & 0xff;
-		panic_on(write_sd(&temp, MALTA_SWAP_LBAM, 1));
-		// Step 4: Write the 23:16 bits of sector number to LBAH register
-		temp = (secno >> 16) & 0xff;
-		panic_on(write_sd(&temp, MALTA_SWAP_LBAH, 1));
-		// Step 5: Write the 27:24 bits of sector number, addressing mode
-		// and diskno to DEVICE register
-		temp = ((secno >> 24) & 0x0f) | MALTA_SWAP_LBA | (diskno << 4);
-		panic_on(write_sd(&temp, MALTA_SWAP_DEVICE, 1));
-		// Step 6: Write the working mode to STATUS register
-		temp = MALTA_SWAP_CMD_PIO_WRITE;
-		panic_on(write_sd(&temp, MALTA_SWAP_STATUS, 1));
-		// Step 7: Wait until the SWAP is ready
-		temp = wait_sd_ready();
-		// Step 8: Write the data to device
-		for (int i = 0; i < SECT_SIZE / 4; i++) {
-			/* Exercise 5.3: Your code here. (9/9) */
-			panic_on(write_sd(src + offset + i * 4, MALTA_SWAP_DATA, 4));
+	while (nsecs > 0) {
+		u_int n = MIN(nsecs, (u_int)SD_MAX_NSECT);
+		sd_command(diskno, secno, n, MALTA_SWAP_CMD_PIO_WRITE);
+		for (u_int i = 0; i < n; i++) {
+			sd_sect_out(src);
+			src += SECT_SIZE;
 		}
-		// Step 9: Check SWAP status
-		panic_on(read_sd(&temp, MALTA_SWAP_STATUS, 1));
-
-		offset += SECT_SIZE;
-		secno += 1;
+		secno += n;
+		nsecs -= n;
 	}
+	// The last sector is committed once BUSY drops.
+	wait_sd_ready();
 }
 
 void write_page(struct Page *pp, u_int bno) {
@@ -167,6 +171,45 @@ void read_page(struct Page *pp, u_int bno) {
 	sd_read(2, bno * SECT2BLK, kva, SECT2BLK);
 }
 
+/* Write `n` pages to the contiguous blocks [bno, bno + n).
+ * The pages need not be physically contiguous; a single command covers up to
+ * SD_MAX_NSECT / SECT2BLK of them.
+ */
+void write_pages(struct Page **pps, u_int bno, u_int n) {
+	while (n > 0) {
+		u_int run = MIN(n, (u_int)(SD_MAX_NSECT / SECT2BLK));
+		sd_command(2, bno * SECT2BLK, run * SECT2BLK, MALTA_SWAP_CMD_PIO_WRITE);
+		for (u_int i = 0; i < run; i++) {
+			u_long kva = page2kva(pps[i]);
+			for (u_int s = 0; s < SECT2BLK; s++) {
+				sd_sect_out((void *)(kva + s * SECT_SIZE));
+			}
+		}
+		pps += run;
+		bno += run;
+		n -= run;
+	}
+	wait_sd_ready();
+}
+
+// Read the contiguous blocks [bno, bno + n) into `n` pages.
+void read_pages(struct Page **pps, u_int bno, u_int n) {
+	while (n > 0) {
+		u_int run = MIN(n, (u_int)(SD_MAX_NSECT / SECT2BLK));
+		sd_command(2, bno * SECT2BLK, run * SECT2BLK, MALTA_SWAP_CMD_PIO_READ);
+		for (u_int i = 0; i < run; i++) {
+			u_long kva = page2kva(pps[i]);
+			for (u_int s = 0; s < SECT2BLK; s++) {
+				sd_sect_in((void *)(kva + s * SECT_SIZE));
+			}
+		}
+		pps += run;
+		bno += run;
+		n -= run;
+	}
+	wait_sd_ready();
+}
+
 void test_sdisk() {
 	printk("Testing sdisk...\n");
 	int magic = 0x12345678;
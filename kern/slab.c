@@ -0,0 +1,284 @@
+#include <pmap.h>
+#include <printk.h>
+#include <slab.h>
+#include <string.h>
+
+// All initialized caches, for 'kmem_cache_reap'.
+static LIST_HEAD(, kmem_cache) cache_list = LIST_HEAD_INITIALIZER(cache_list);
+
+// Caches of the 'kmalloc' size classes, and the page blocks taken for larger requests.
+static struct kmem_cache kmalloc_caches[KMALLOC_NCLASS];
+static const char *const kmalloc_names[KMALLOC_NCLASS] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+static u_int kmalloc_npages; // pages held by large requests
+static u_int kmalloc_nlarge; // large requests handed out
+static u_int kmalloc_nfails; // large requests failed for memory
+
+static inline struct Slab *obj2slab(void *obj) {
+	return (struct Slab *)ROUNDDOWN(obj, PAGE_SIZE);
+}
+
+/* Overview:
+ *   Initialize 'cache' to hand out objects of 'objsize' bytes. No memory is taken until the
+ *   first 'kmem_cache_alloc'.
+ */
+void kmem_cache_init(struct kmem_cache *cache, const char *name, u_int objsize) {
+	u_int hdr = ROUND(sizeof(struct Slab), sizeof(void *));
+
+	objsize = ROUND(MAX(objsize, sizeof(void *)), sizeof(void *));
+	assert(objsize <= PAGE_SIZE - hdr);
+
+	cache->name = name;
+	cache->objsize = objsize;
+	cache->objs_per_slab = (PAGE_SIZE - hdr) / objsize;
+	LIST_INIT(&cache->partial);
+	LIST_INIT(&cache->full);
+	LIST_INIT(&cache->empty);
+	cache->nslabs = 0;
+	cache->nobjs = 0;
+	cache->nallocs = 0;
+	cache->nfrees = 0;
+	cache->nfails = 0;
+	LIST_INSERT_HEAD(&cache_list, cache, cache_link);
+}
+
+/* Overview:
+ *   Take a new page from 'page_alloc' and carve it into a slab of free objects.
+ *
+ * Post-Condition:
+ *   Return the new slab (on the 'empty' list of 'cache'), or NULL if out of memory.
+ */
+static struct Slab *slab_grow(struct kmem_cache *cache) {
+	struct Page *pp;
+	if (page_alloc_nozero(&pp) != 0) {
+		return NULL;
+	}
+	pp->pp_ref = 1; // Keep the page away from swapping.
+
+	struct Slab *slab = (struct Slab *)page2kva(pp);
+	u_long obj = (u_long)slab + ROUND(sizeof(struct Slab), sizeof(void *));
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->free = NULL;
+	for (u_int i = 0; i < cache->objs_per_slab; i++, obj += cache->objsize) {
+		*(void **)obj = slab->free;
+		slab->free = (void *)obj;
+	}
+
+	LIST_INSERT_HEAD(&cache->empty, slab, slab_link);
+	cache->nslabs++;
+	return slab;
+}
+
+/* Overview:
+ *   Allocate an object from 'cache'. Partially used slabs are preferred, then empty ones, and
+ *   a new slab is only grown when both are exhausted.
+ *
+ * Post-Condition:
+ *   Return the object (its content is undefined), or NULL if out of memory.
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+	struct Slab *slab = LIST_FIRST(&cache->partial);
+	if (slab == NULL) {
+		slab = LIST_FIRST(&cache->empty);
+		if (slab == NULL && (slab = slab_grow(cache)) == NULL) {
+			cache->nfails++;
+			return NULL;
+		}
+	}
+
+	void *obj = slab->free;
+	slab->free = *(void **)obj;
+	LIST_REMOVE(slab, slab_link);
+	if (++slab->inuse == cache->objs_per_slab) {
+		LIST_INSERT_HEAD(&cache->full, slab, slab_link);
+	} else {
+		LIST_INSERT_HEAD(&cache->partial, slab, slab_link);
+	}
+	cache->nobjs++;
+	cache->nallocs++;
+	return obj;
+}
+
+/* Overview:
+ *   Return 'obj', allocated from 'cache', to its slab.
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+	struct Slab *slab = obj2slab(obj);
+	assert(slab->cache == cache && slab->inuse > 0);
+
+	*(void **)obj = slab->free;
+	slab->free = obj;
+	LIST_REMOVE(slab, slab_link);
+	if (--slab->inuse == 0) {
+		LIST_INSERT_HEAD(&cache->empty, slab, slab_link);
+	} else {
+		LIST_INSERT_HEAD(&cache->partial, slab, slab_link);
+	}
+	cache->nobjs--;
+	cache->nfrees++;
+}
+
+/* Overview:
+ *   Give the pages of all empty slabs back to free memory. Called by 'page_alloc' under
+ *   memory pressure, before it resorts to swapping.
+ *
+ * Post-Condition:
+ *   Return the number of pages freed.
+ */
+int kmem_cache_reap(void) {
+	struct kmem_cache *cache;
+	struct Slab *slab;
+	int n = 0;
+
+	LIST_FOREACH (cache, &cache_list, cache_link) {
+		while ((slab = LIST_FIRST(&cache->empty)) != NULL) {
+			LIST_REMOVE(slab, slab_link);
+			cache->nslabs--;
+			struct Page *pp = pa2page(PADDR(slab));
+			pp->pp_ref = 0;
+			page_free(pp);
+			n++;
+		}
+	}
+	return n;
+}
+
+// Return the number of pages held by the object caches and 'kmalloc'.
+u_int kmem_pages(void) {
+	struct kmem_cache *cache;
+	u_int n = kmalloc_npages;
+
+	LIST_FOREACH (cache, &cache_list, cache_link) {
+		n += cache->nslabs;
+	}
+	return n;
+}
+
+void kmem_print_stats(void) {
+	struct kmem_cache *cache;
+
+	printk("%-14s %6s %6s %6s %8s %8s %5s\n", "cache", "size", "objs", "slabs", "allocs",
+	       "frees", "fails");
+	LIST_FOREACH (cache, &cache_list, cache_link) {
+		printk("%-14s %6d %6d %6d %8d %8d %5d\n", cache->name, cache->objsize, cache->nobjs,
+		       cache->nslabs, cache->nallocs, cache->nfrees, cache->nfails);
+	}
+	printk("kmalloc: %d large blocks in %d pages, %d failed\n", kmalloc_nlarge, kmalloc_npages,
+	       kmalloc_nfails);
+}
+
+void kmalloc_init(void) {
+	for (u_int i = 0; i < KMALLOC_NCLASS; i++) {
+		kmem_cache_init(&kmalloc_caches[i], kmalloc_names[i], KMALLOC_MIN << i);
+	}
+}
+
+/* Overview:
+ *   Allocate 'size' bytes of kernel memory, from the cache of the smallest size class holding
+ *   them, or as a block of whole pages if larger than KMALLOC_MAX. Objects are aligned to a
+ *   word, and page blocks to their size.
+ *
+ * Post-Condition:
+ *   Return the memory (its content is undefined), or NULL if 'size' is 0 or out of memory.
+ */
+void *kmalloc(u_int size) {
+	if (size == 0) {
+		return NULL;
+	}
+	if (size <= KMALLOC_MAX) {
+		u_int i = 0;
+		while ((KMALLOC_MIN << i) < size) {
+			i++;
+		}
+		return kmem_cache_alloc(&kmalloc_caches[i]);
+	}
+
+	u_int order = 0;
+	while ((PAGE_SIZE << order) < size) {
+		order++;
+	}
+	struct Page *pp;
+	if (order >= PAGE_NORDER || page_alloc_order(order, &pp) != 0) {
+		kmalloc_nfails++;
+		return NULL;
+	}
+	for (u_int i = 0; i < (1 << order); i++) {
+		pp[i].pp_ref = 1; // Keep the pages away from swapping.
+	}
+	pp->pp_flags |= PG_KMALLOC;
+	pp->pp_order = order;
+	kmalloc_npages += 1 << order;
+	kmalloc_nlarge++;
+	return (void *)page2kva(pp);
+}
+
+/* Overview:
+ *   Release 'obj', allocated by 'kmalloc'. Does nothing if 'obj' is NULL.
+ */
+void kfree(void *obj) {
+	if (obj == NULL) {
+		return;
+	}
+	if ((u_long)obj % PAGE_SIZE != 0) { // Slab objects follow the slab header.
+		kmem_cache_free(obj2slab(obj)->cache, obj);
+		return;
+	}
+
+	struct Page *pp = pa2page(PADDR(obj));
+	assert(pp->pp_flags & PG_KMALLOC);
+	u_int order = pp->pp_order;
+	pp->pp_flags &= ~PG_KMALLOC;
+	for (u_int i = 0; i < (1 << order); i++) {
+		pp[i].pp_ref = 0;
+	}
+	kmalloc_npages -= 1 << order;
+	kmalloc_nlarge--;
+	page_free_order(pp, order);
+}
+
+/* Overview:
+ *   Self-test of 'kmalloc': objects of every size class and page blocks are allocated,
+ *   filled, checked for overlaps and freed, and all memory taken must be given back by
+ *   'kmem_cache_reap'.
+ */
+void test_kmalloc(void) {
+	static const u_int sizes[] = {1, 16, 17, 100, 512, 1000, 1024, 1025, 4096, 5000, 20000};
+	static u_char *objs[sizeof(sizes) / sizeof(sizes[0])][8];
+	u_int nfree = page_nfree;
+
+	printk("Testing kmalloc...\n");
+	panic_on(kmalloc(0) != NULL);
+	for (u_int k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+		for (u_int j = 0; j < 8; j++) {
+			u_char *p = kmalloc(sizes[k]);
+			panic_on(p == NULL || (u_long)p % sizeof(void *) != 0);
+			memset(p, k * 8 + j, sizes[k]);
+			objs[k][j] = p;
+		}
+	}
+	for (u_int k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+		for (u_int j = 0; j < 8; j++) {
+			for (u_int i = 0; i < sizes[k]; i++) {
+				panic_on(objs[k][j][i] != (u_char)(k * 8 + j));
+			}
+		}
+	}
+	kmem_print_stats();
+
+	for (u_int k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+		for (u_int j = 0; j < 8; j++) {
+			kfree(objs[k][j]);
+		}
+	}
+	kfree(NULL);
+	panic_on(kmalloc_npages != 0 || kmalloc_nlarge != 0);
+	for (u_int i = 0; i < KMALLOC_NCLASS; i++) {
+		panic_on(kmalloc_caches[i].nobjs != 0);
+	}
+	kmem_cache_reap();
+	panic_on(page_nfree < nfree);
+	printk("test_kmalloc succeeded!\n");
+}
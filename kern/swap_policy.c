@@ -0,0 +1,336 @@
+#include <pmap.h>
+#include <swap.h>
+
+/* Page replacement policies.
+ *
+ * A policy keeps track of the swappable PPages (those with registered mappings)
+ * and picks victims among them for swap_out(). Pages are linked through
+ * 'swap_link', and 'accessed' is their reference bit, which is cleared with
+ * swap_clear_ref() so that later uses are seen again. 'pp_age' is private to
+ * the policy; it is kept with the swap block while the page is swapped out.
+ * A page flagged PG_PINNED must never be picked.
+ *
+ * The policy is chosen at build time with 'make MOS_SWAP_POLICY=<name>', where
+ * <name> is one of fifo, clock (default), wsclock, 2q and aging.
+ */
+
+struct Page_tailq page_swap_queue;
+
+static void queue_init(void) {
+	TAILQ_INIT(&page_swap_queue);
+}
+
+static void queue_insert(struct Page *pp) {
+	TAILQ_INSERT_TAIL(&page_swap_queue, pp, swap_link);
+}
+
+static void queue_remove(struct Page_tailq *queue, struct Page *pp) {
+	TAILQ_REMOVE(queue, pp, swap_link);
+	pp->swap_link.tqe_next = NULL;
+	pp->swap_link.tqe_prev = NULL;
+}
+
+static void ref_access(struct Page *pp) {
+	pp->accessed = 1;
+}
+
+/* FIFO: evict the page that has been swappable for the longest time. */
+static void fifo_access(struct Page *pp) {
+}
+
+static void fifo_remove(struct Page *pp) {
+	queue_remove(&page_swap_queue, pp);
+}
+
+static struct Page *fifo_pick(void) {
+	struct Page *pp;
+	TAILQ_FOREACH(pp, &page_swap_queue, swap_link) {
+		vmstat.scanned++;
+		if (!(pp->pp_flags & PG_PINNED)) {
+			fifo_remove(pp);
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+/* Clock (second chance): 'page_swap_queue' is a circle swept by a hand. A referenced page
+ * has its bit cleared and is passed over; the first unreferenced one is evicted.
+ */
+static struct Page *clock_hand; // Next page to look at, NULL for the first one.
+
+static struct Page *clock_next(struct Page *pp) {
+	struct Page *next = TAILQ_NEXT(pp, swap_link);
+	return next ? next : TAILQ_FIRST(&page_swap_queue);
+}
+
+// New pages go right behind the hand, so they are looked at last.
+static void clock_insert(struct Page *pp) {
+	if (clock_hand != NULL) {
+		TAILQ_INSERT_BEFORE(clock_hand, pp, swap_link);
+	} else {
+		TAILQ_INSERT_TAIL(&page_swap_queue, pp, swap_link);
+	}
+}
+
+static void clock_remove(struct Page *pp) {
+	if (clock_hand == pp) {
+		clock_hand = TAILQ_NEXT(pp, swap_link);
+	}
+	queue_remove(&page_swap_queue, pp);
+}
+
+static struct Page *clock_pick(void) {
+	if (TAILQ_EMPTY(&page_swap_queue)) { return NULL; }
+
+	struct Page *start = clock_hand ? clock_hand : TAILQ_FIRST(&page_swap_queue);
+	struct Page *pp = start;
+	// The first sweep clears all reference bits, so the second one must find a victim.
+	for (int sweep = 0; sweep < 2;) {
+		vmstat.scanned++;
+		if (!(pp->pp_flags & PG_PINNED)) {
+			if (!pp->accessed) {
+				clock_remove(pp);
+				return pp;
+			}
+			swap_clear_ref(pp);
+		}
+		if ((pp = clock_next(pp)) == start) { sweep++; }
+	}
+	return NULL; // Every page is pinned.
+}
+
+/* WSClock: clock over the pages' last use times. A page not referenced for WSCLOCK_TAU
+ * ticks has left the working set and is evicted; if there is none, the least recently used
+ * page seen in the sweep is. A tick is a reference reported to 'access'.
+ */
+#define WSCLOCK_TAU 8192
+
+static u_int wsclock_now;
+
+static void wsclock_insert(struct Page *pp) {
+	pp->pp_age = wsclock_now;
+	clock_insert(pp);
+}
+
+static void wsclock_access(struct Page *pp) {
+	pp->accessed = 1;
+	wsclock_now++;
+}
+
+static struct Page *wsclock_pick(void) {
+	if (TAILQ_EMPTY(&page_swap_queue)) { return NULL; }
+
+	struct Page *start = clock_hand ? clock_hand : TAILQ_FIRST(&page_swap_queue);
+	struct Page *pp = start, *oldest = NULL;
+	do {
+		vmstat.scanned++;
+		if (!(pp->pp_flags & PG_PINNED)) {
+			if (pp->accessed) {
+				swap_clear_ref(pp);
+				pp->pp_age = wsclock_now;
+			} else if (wsclock_now - pp->pp_age > WSCLOCK_TAU) {
+				clock_remove(pp);
+				return pp;
+			}
+			if (oldest == NULL || (int)(pp->pp_age - oldest->pp_age) < 0) {
+				oldest = pp;
+			}
+		}
+	} while ((pp = clock_next(pp)) != start);
+
+	if (oldest != NULL) { clock_remove(oldest); }
+	return oldest;
+}
+
+/* 2Q: pages start on the FIFO A1in ('page_swap_queue'). Only a page swapped in again soon
+ * after it was evicted from A1in, while it would still be on the ghost list A1out, goes to
+ * the hot list Am, which is managed as a clock. A1in is kept to about TWOQ_KIN of the
+ * swappable pages, and A1out remembers the last TWOQ_KOUT evictions from A1in.
+ */
+#define TWOQ_HOT 0x80000000   // pp_age: on Am
+#define TWOQ_GHOST 0x40000000 // pp_age: evicted from A1in, low bits are the eviction number
+#define TWOQ_SEQ (TWOQ_GHOST - 1)
+#define TWOQ_KIN(n) ((n) / 4)
+#define TWOQ_KOUT (npage / 2)
+
+static struct Page_tailq twoq_hot;
+static u_int twoq_nin, twoq_nhot;
+static u_int twoq_nevict; // Evictions from A1in so far.
+
+static void twoq_init(void) {
+	queue_init();
+	TAILQ_INIT(&twoq_hot);
+}
+
+static void twoq_insert(struct Page *pp) {
+	if ((pp->pp_age & TWOQ_GHOST) && ((twoq_nevict - pp->pp_age) & TWOQ_SEQ) < TWOQ_KOUT) {
+		pp->pp_age = TWOQ_HOT;
+		TAILQ_INSERT_TAIL(&twoq_hot, pp, swap_link);
+		twoq_nhot++;
+	} else {
+		pp->pp_age = 0;
+		queue_insert(pp);
+		twoq_nin++;
+	}
+}
+
+static void twoq_remove(struct Page *pp) {
+	if (pp->pp_age & TWOQ_HOT) {
+		queue_remove(&twoq_hot, pp);
+		twoq_nhot--;
+	} else {
+		queue_remove(&page_swap_queue, pp);
+		twoq_nin--;
+	}
+}
+
+static struct Page *twoq_pick_in(void) {
+	struct Page *pp;
+	TAILQ_FOREACH(pp, &page_swap_queue, swap_link) {
+		vmstat.scanned++;
+		if (!(pp->pp_flags & PG_PINNED)) {
+			twoq_remove(pp);
+			pp->pp_age = TWOQ_GHOST | (twoq_nevict++ & TWOQ_SEQ);
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+static struct Page *twoq_pick_hot(void) {
+	// Referenced pages are moved to the tail, so two rounds clear every reference bit.
+	for (u_int n = 2 * twoq_nhot; n > 0; n--) {
+		struct Page *pp = TAILQ_FIRST(&twoq_hot);
+		vmstat.scanned++;
+		if (!(pp->pp_flags & PG_PINNED) && !pp->accessed) {
+			twoq_remove(pp);
+			return pp;
+		}
+		if (pp->accessed) { swap_clear_ref(pp); }
+		TAILQ_REMOVE(&twoq_hot, pp, swap_link);
+		TAILQ_INSERT_TAIL(&twoq_hot, pp, swap_link);
+	}
+	return NULL;
+}
+
+static struct Page *twoq_pick(void) {
+	struct Page *pp;
+	if (twoq_nin > TWOQ_KIN(twoq_nin + twoq_nhot) || twoq_nhot == 0) {
+		if ((pp = twoq_pick_in()) != NULL) { return pp; }
+		return twoq_pick_hot();
+	}
+	if ((pp = twoq_pick_hot()) != NULL) { return pp; }
+	return twoq_pick_in();
+}
+
+/* Aging (NFU approximation): every page has an 8-bit history of its reference bit in
+ * 'pp_age', shifted right at each aging pass with the bit entering on the left. A pass is
+ * made whenever the victims chosen by the last one are used up; it collects the
+ * AGING_NCAND pages with the smallest histories as the next victims.
+ */
+#define AGING_NCAND SWAP_CLUSTER
+
+static struct Page *aging_cand[AGING_NCAND]; // Sorted by 'pp_age', smallest first.
+static u_int aging_ncand, aging_pos;
+
+static void aging_insert(struct Page *pp) {
+	pp->pp_age = 0;
+	queue_insert(pp);
+}
+
+static void aging_remove(struct Page *pp) {
+	for (u_int i = aging_pos; i < aging_ncand; i++) {
+		if (aging_cand[i] == pp) { aging_cand[i] = NULL; }
+	}
+	queue_remove(&page_swap_queue, pp);
+}
+
+static void aging_pass(void) {
+	struct Page *pp;
+	aging_ncand = aging_pos = 0;
+	TAILQ_FOREACH(pp, &page_swap_queue, swap_link) {
+		vmstat.scanned++;
+		pp->pp_age = (pp->pp_age >> 1) | (pp->accessed ? 0x80 : 0);
+		if (pp->accessed) { swap_clear_ref(pp); }
+		if (pp->pp_flags & PG_PINNED) { continue; }
+
+		u_int i;
+		if (aging_ncand < AGING_NCAND) {
+			i = aging_ncand++;
+		} else if (pp->pp_age < aging_cand[AGING_NCAND - 1]->pp_age) {
+			i = AGING_NCAND - 1;
+		} else {
+			continue;
+		}
+		for (; i > 0 && aging_cand[i - 1]->pp_age > pp->pp_age; i--) {
+			aging_cand[i] = aging_cand[i - 1];
+		}
+		aging_cand[i] = pp;
+	}
+}
+
+static struct Page *aging_pick(void) {
+	for (int pass = 0;; pass++) {
+		while (aging_pos < aging_ncand) {
+			struct Page *pp = aging_cand[aging_pos++];
+			if (pp != NULL && !(pp->pp_flags & PG_PINNED)) {
+				aging_remove(pp);
+				return pp;
+			}
+		}
+		if (pass == 1) { return NULL; } // Every page is pinned.
+		aging_pass();
+	}
+}
+
+const struct swap_policy swap_policy_fifo = {
+    .name = "fifo",
+    .init = queue_init,
+    .insert = queue_insert,
+    .access = fifo_access,
+    .remove = fifo_remove,
+    .pick = fifo_pick,
+};
+
+const struct swap_policy swap_policy_clock = {
+    .name = "clock",
+    .init = queue_init,
+    .insert = clock_insert,
+    .access = ref_access,
+    .remove = clock_remove,
+    .pick = clock_pick,
+};
+
+const struct swap_policy swap_policy_wsclock = {
+    .name = "wsclock",
+    .init = queue_init,
+    .insert = wsclock_insert,
+    .access = wsclock_access,
+    .remove = clock_remove,
+    .pick = wsclock_pick,
+};
+
+const struct swap_policy swap_policy_2q = {
+    .name = "2q",
+    .init = twoq_init,
+    .insert = twoq_insert,
+    .access = ref_access,
+    .remove = twoq_remove,
+    .pick = twoq_pick,
+};
+
+const struct swap_policy swap_policy_aging = {
+    .name = "aging",
+    .init = queue_init,
+    .insert = aging_insert,
+    .access = ref_access,
+    .remove = aging_remove,
+    .pick = aging_pick,
+};
+
+#ifndef MOS_SWAP_POLICY
+#define MOS_SWAP_POLICY swap_policy_clock
+#endif
+
+const struct swap_policy *const swap_policy = &MOS_SWAP_POLICY;
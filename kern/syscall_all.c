@@ -5,7 +5,9 @@
 #include <swap.h>
 #include <printk.h>
 #include <sched.h>
+#include <slab.h>
 #include <syscall.h>
+#include <zswap.h>
 
 extern struct Env *curenv;
 
@@ -189,18 +191,28 @@ int sys_mem_map(u_int srcid, u_int srcva, u_int dstid, u_int dstva, u_int perm)
 	try(envid2env(srcid, &srcenv, 1));
 	try(envid2env(dstid, &dstenv, 1));
 
+	// A swapped-out page is shared as it is, without reading it back (see swap_share).
+	if (srcva != UCOW) {
+		int r = swap_share(srcenv->env_pgdir, srcva, dstenv->env_pgdir, dstenv->env_asid,
+				   dstva, perm);
+		if (r != -E_INVAL) { return r; }
+	}
 
 	// Maintain swappable attribute of ???.
 	struct Page *orgp = page_lookup(dstenv->env_pgdir, dstva, NULL);
 	int swappable_org = 0;
-	if (orgp != NULL) { swappable_org = !LIST_EMPTY(page2ste(orgp)); }
+	if (orgp != NULL) { swappable_org = ste_mapped(page2ste(orgp)); }
 
 	/* Step 4: Find the physical page mapped at 'srcva' in the address space of 'srcid'. */
 	/* Return -E_INVAL if 'srcva' is not mapped. */
 	Pte *pte;
 	struct Page *srcp = page_lookup(srcenv->env_pgdir, srcva, &pte);
 	if (srcp == NULL) { return -E_INVAL; };
-	int swappable_src = !LIST_EMPTY(page2ste(srcp));
+	if (srcp == zero_page && (perm & PTE_D)) { // A writable share needs a page of its own.
+		try(zero_page_break(srcenv->env_pgdir, srcenv->env_asid, srcva));
+		srcp = page_lookup(srcenv->env_pgdir, srcva, &pte);
+	}
+	int swappable_src = ste_mapped(page2ste(srcp));
 
 	//if (srcva == 0x7f3fd000 && dstid == 0x2803) { printk("origin page: pgdir=%x, pte=%x, ppn=%d\n", srcenv->env_pgdir, *pte, page2ppn(srcp)); }
 
@@ -443,7 +455,11 @@ int sys_ipc_try_send(u_int envid, u_int value, u_int srcva, u_int perm) {
 		/* Exercise 4.8: Your code here. (8/8) */
 		p = page_lookup(curenv->env_pgdir, srcva, NULL);
 		if (p == NULL) { return -E_INVAL; }
-		int swappable = !LIST_EMPTY(page2ste(p));
+		if (p == zero_page && (perm & PTE_D)) {
+			try(zero_page_break(curenv->env_pgdir, curenv->env_asid, srcva));
+			p = page_lookup(curenv->env_pgdir, srcva, NULL);
+		}
+		int swappable = ste_mapped(page2ste(p));
 
 		page_insert(e->env_pgdir, e->env_asid, p, e->env_ipc_dstva, perm);
 		if (swappable
@@ -543,6 +559,75 @@ int sys_read_dev(u_int va, u_int pa, u_int len) {
 	return 0;
 }
 
+/* Overview:
+ *   Copy the virtual memory statistics (see include/vmstat.h) to 'buf' in user space.
+ *
+ * Post-Condition:
+ *   Return 0 on success.
+ *   Return -E_INVAL if 'buf' is not a legal user address range.
+ */
+int sys_vmstat(struct vmstat *buf) {
+	if (is_illegal_va_range((u_long)buf, sizeof(*buf))) { return -E_INVAL; }
+
+	vmstat.zswap_stores = zswap_stats.stores;
+	vmstat.zswap_rejects = zswap_stats.rejects;
+	vmstat.zswap_full = zswap_stats.full;
+	vmstat.zswap_hits = zswap_stats.hits;
+	vmstat.zswap_misses = zswap_stats.misses;
+	vmstat.zswap_objs = zswap_stats.nobjs;
+	vmstat.zswap_bytes = zswap_stats.nbytes;
+	vmstat.zswap_pages = zswap_stats.npages;
+
+	vmstat.free_pages = page_nfree;
+	for (u_int i = 0; i < PAGE_NORDER; i++) {
+		vmstat.free_blocks[i] = page_free_area.nfree[i];
+	}
+	vmstat.zeroed_pages = page_free_area.nzeroed;
+	vmstat.kmem_pages = kmem_pages();
+	vmstat.total_pages = npage;
+	vmstat.swap_used = sd_total - sd_nfree;
+	vmstat.swap_total = sd_total;
+
+	memcpy(buf, &vmstat, sizeof(*buf));
+	return 0;
+}
+
+/* Overview:
+ *   Set the resident limit of 'envid' to 'npages' pages, or remove it if 'npages' is 0.
+ *   Over its limit, an env's own pages are the first victims when memory runs short, and if
+ *   'hard' is set, each of its faults also swaps out its own pages to get back within it.
+ *
+ * Post-Condition:
+ *   Return 0 on success, < 0 on error. Errors are:
+ *   Return the original error if underlying calls fail.
+ */
+int sys_set_rss_limit(u_int envid, u_int npages, u_int hard) {
+	struct Env *e;
+	try(envid2env(envid, &e, 1));
+
+	if (e->env_rss_limit == 0 && npages != 0) {
+		LIST_INSERT_HEAD(&env_rss_list, e, env_rss_link);
+	} else if (e->env_rss_limit != 0 && npages == 0) {
+		LIST_REMOVE(e, env_rss_link);
+	}
+	e->env_rss_limit = npages;
+	e->env_rss_hard = hard != 0;
+	return 0;
+}
+
+/* Overview:
+ *   Get the number of mappings, among all envs, of the page mapped at 'va' in the current env.
+ *   A swapped-out page is counted where it is, without swapping it in.
+ *
+ * Post-Condition:
+ *   Return the count, or 0 if 'va' maps no page.
+ *   Return -E_INVAL if 'va' is illegal (a user program cannot map it).
+ */
+int sys_pageref(u_int va) {
+	if (is_illegal_va(va)) { return -E_INVAL; }
+	return swap_pageref(curenv->env_pgdir, va);
+}
+
 void *syscall_table[MAX_SYSNO] = {
     [SYS_putchar] = sys_putchar,
     [SYS_print_cons] = sys_print_cons,
@@ -562,6 +647,9 @@ void *syscall_table[MAX_SYSNO] = {
     [SYS_cgetc] = sys_cgetc,
     [SYS_write_dev] = sys_write_dev,
     [SYS_read_dev] = sys_read_dev,
+    [SYS_vmstat] = sys_vmstat,
+    [SYS_set_rss_limit] = sys_set_rss_limit,
+    [SYS_pageref] = sys_pageref,
 };
 
 /* Overview:
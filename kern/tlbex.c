@@ -1,5 +1,6 @@
 #include <bitops.h>
 #include <env.h>
+#include <machine.h>
 #include <pmap.h>
 #include <swap.h>
 #include <printk.h>
@@ -17,7 +18,62 @@ void tlb_invalidate(u_int asid, u_long va) {
 }
 /* End of Key Code "tlb_invalidate" */
 
-static void passive_alloc(u_int va, Pde *pgdir, u_int asid) {
+/* Large pages
+ *
+ * An aligned run of 2^LPAGE_ORDER or 2^LPAGE_ORDER_MAX pages whose PTEs map
+ * contiguous frames, aligned to the run, with the same EntryLo flags can be
+ * mapped by one EntryLo through CP0 PageMask. Where both runs of a TLB entry
+ * pair are such, the refill handler writes a large-page entry (see
+ * large_entrylo). Nothing marks the runs in the page table: any change to one
+ * of their PTEs (a swap-out, a COW break, a reference sample) goes through
+ * tlb_invalidate, whose probe matches the large entry too, and the next refill
+ * finds the run split and maps 4 KiB pages again.
+ *
+ * Runs come from large_alloc, which backs the first store to an untouched run
+ * with a block of contiguous frames while free memory is plentiful.
+ */
+
+// Whether a free block of 2^`order` pages is there, so that taking it won't reclaim.
+static int large_block_free(u_int order) {
+	for (u_int o = order; o < PAGE_NORDER; o++) {
+		if (page_free_area.nfree[o] != 0) { return 1; }
+	}
+	return 0;
+}
+
+// Back the store to `va` with a block of contiguous frames, mapping the whole aligned run
+// around it, if no page of the run was touched yet. `pte` is the PTE of `va`, NULL if it has
+// no page table. Return whether it did.
+static int large_alloc(u_int va, Pde *pgdir, u_int asid, Pte *pte) {
+	struct Page *p;
+
+	for (int order = LPAGE_ORDER_MAX; order >= LPAGE_ORDER; order -= 2) {
+		u_int n = 1 << order;
+		u_long base = ROUNDDOWN(va, n * PAGE_SIZE);
+		// Not in the stack's page table, where few pages are ever used.
+		if (base < UTEXT || base + n * PAGE_SIZE > USTACKTOP - PDMAP) { continue; }
+		if (page_nfree < SWAP_WMARK_HIGH + 2 * n || !large_block_free(order)) { continue; }
+		u_int i = 0;
+		if (pte != NULL) {
+			Pte *run = pte - PTX(va) % n;
+			for (; i < n && run[i] == 0; i++) {}
+		}
+		if (pte != NULL && i < n) { continue; }
+
+		panic_on(page_alloc_order(order, &p));
+		for (i = 0; i < n; i++) {
+			panic_on(page_insert(pgdir, asid, p + i, base + i * PAGE_SIZE, PTE_D));
+			p[i].pp_flags |= PG_LARGE;
+			p[i].pp_order = order;
+			swap_register(p + i, pgdir, base + i * PAGE_SIZE, asid);
+		}
+		vmstat.large_allocs++;
+		return 1;
+	}
+	return 0;
+}
+
+static void passive_alloc(u_int va, Pde *pgdir, u_int asid, int store, Pte *pte) {
 	struct Page *p = NULL;
 
 	if (va < UTEMP) {
@@ -31,6 +87,20 @@ static void passive_alloc(u_int va, Pde *pgdir, u_int asid) {
 	if (va >= ULIM) {
 		panic("kernel address"); }
 
+	// A first load from a swappable page: map the shared zero page. It's left read-only in
+	// the TLB, so the first store gets its own page (see do_tlb_mod).
+	if (!store && va < USTACKTOP - PAGE_SIZE) {
+		panic_on(page_insert(pgdir, asid, zero_page, PTE_ADDR(va), PTE_D));
+		vmstat.zero_maps++;
+		return;
+	}
+
+	u_int t0 = read_cp0_count();
+	if (large_alloc(va, pgdir, asid, pte)) {
+		vmstat.passive_allocs++;
+		vmstat.cyc_passive += read_cp0_count() - t0;
+		return;
+	}
 	panic_on(page_alloc(&p));
 
 	u_int perm = (va >= UVPT && va < ULIM) ? 0 : PTE_D;
@@ -40,13 +110,77 @@ static void passive_alloc(u_int va, Pde *pgdir, u_int asid) {
 		//if (va == 0x443ffffc) { printk("register!\n"); }
 		swap_register(p, pgdir, PTE_ADDR(va), asid); // Register ppage for swap.
 	}
+	vmstat.passive_allocs++;
+	vmstat.cyc_passive += read_cp0_count() - t0;
 	//printk("+data page: %08x, %08x -> %d\n", PTE_ADDR(va), pgdir, page2ppn(p));
 }
 
+// EntryLo for 'pte'. A page read ahead by swap_back, or whose reference bit is being sampled
+// (PTE_REFTRAP), is left out of the TLB until its next use goes through page_lookup.
+// A page with a clean copy in swap or on the disk of a refetching env, or the zero page, is
+// loaded read-only, so that do_tlb_mod sees the first store to it.
+static u_long pte2entrylo(Pte pte) {
+	if (!(pte & PTE_V)) {
+		return pte >> 6;
+	}
+	struct Page *pp = pa2page(pte);
+	if ((pte & PTE_REFTRAP) || (pp->pp_flags & PG_READAHEAD)) {
+		return 0;
+	}
+	if (pp->pp_flags & (PG_SWAPCACHE | PG_CLEAN | PG_ZERO)) {
+		return (pte & ~PTE_D) >> 6;
+	}
+	return pte >> 6;
+}
+
+// Whether the run of 2^`order` pages from `pte` can be mapped as a large page.
+static int large_run(Pte *pte, u_int order) {
+	u_int n = 1 << order;
+	u_long lo = pte2entrylo(pte[0]);
+	if (!(lo & (PTE_V >> 6)) || PPN(pte[0]) % n != 0) { return 0; }
+	for (u_int i = 1; i < n; i++) {
+		if (pte2entrylo(pte[i]) != lo + (i << (PGSHIFT - 6))) { return 0; }
+	}
+	return 1;
+}
+
+/* Set the EntryLos of a large-page entry for the pair of runs around `va`, whose resident PTE
+ * is `pte`, and return its PageMask. Return 0 if the runs can't be mapped so, leaving
+ * 'pentrylo' alone.
+ */
+static u_long large_entrylo(u_long *pentrylo, u_long va, u_int asid, Pte *pte) {
+	struct Page *pp = pa2page(*pte);
+	if (!(pp->pp_flags & PG_LARGE)) { return 0; }
+
+	for (int order = pp->pp_order; order >= LPAGE_ORDER; order -= 2) {
+		u_int n = 1 << order;
+		Pte *pair = pte - PTX(va) % (2 * n);
+		if (!large_run(pair, order) || !large_run(pair + n, order)) { continue; }
+
+		// Knock out the 4 KiB entries the large one overlaps, and count the use of its pages
+		// like a refill of each would have.
+		u_long base = ROUNDDOWN(va, 2 * n * PAGE_SIZE);
+		for (u_int i = 0; i < n; i++) {
+			tlb_invalidate(asid, base + i * 2 * PAGE_SIZE);
+		}
+		for (u_int i = 0; i < 2 * n; i++) {
+			swap_policy->access(pa2page(pair[i]));
+		}
+		pentrylo[0] = pte2entrylo(pair[0]);
+		pentrylo[1] = pte2entrylo(pair[n]);
+		vmstat.large_refills++;
+		return PAGEMASK(order);
+	}
+	return 0;
+}
+
 /* Overview:
- *  Refill TLB.
+ *  Refill TLB. Return the PageMask of the entry: 0 for a pair of 4 KiB pages, or that of a
+ *  large page (see large_entrylo).
  */
-void _do_tlb_refill(u_long *pentrylo, u_int va, u_int asid) {
+u_long _do_tlb_refill(u_long *pentrylo, u_int va, u_int asid) {
+	int store = (read_cp0_cause() & 0x7c) != (2 << 2); // Not a TLBL (load or fetch) miss.
+	u_int t0 = read_cp0_count();
 	tlb_invalidate(asid, va);
 	Pte *ppte = NULL;
 	/* Hints:
@@ -57,18 +191,36 @@ void _do_tlb_refill(u_long *pentrylo, u_int va, u_int asid) {
 	 *  allocate a new page using 'passive_alloc' until 'page_lookup' succeeds.
 	 */
 
+	// A fault from user mode may block the env on a swap-in read (see swap_back), and is
+	// taken again once the read is done.
+#if !defined(LAB) || LAB >= 3
+	swap_in_may_block = curenv != NULL && read_cp0_epc() < ULIM;
+#endif
 	while (page_lookup(cur_pgdir, va, &ppte) == NULL) {
+		swap_in_may_block = 0; // Not while allocating: the page would be lost.
 		//if ((ppte != NULL) && ((*ppte) & PTE_SWAPPED)) {
 			//printk("swapped out page\n");
 			//swap_back(*ppte);
 		//} else {
-			passive_alloc(va, cur_pgdir, asid);
+			passive_alloc(va, cur_pgdir, asid, store, ppte);
 		//}
 	}
+	swap_in_may_block = 0;
+#if !defined(LAB) || LAB >= 3
+	if (curenv != NULL) {
+		swap_rss_check(curenv, va);
+	}
+#endif
 
-	ppte = (Pte *)((u_long)ppte & ~0x7); // 0x7: 2 for a 32bit u_long, 1 for odd/even
-	pentrylo[0] = ppte[0] >> 6;
-	pentrylo[1] = ppte[1] >> 6;
+	u_long mask = large_entrylo(pentrylo, va, asid, ppte);
+	if (mask == 0) {
+		ppte = (Pte *)((u_long)ppte & ~0x7); // 0x7: 2 for a 32bit u_long, 1 for odd/even
+		pentrylo[0] = pte2entrylo(ppte[0]);
+		pentrylo[1] = pte2entrylo(ppte[1]);
+	}
+	vmstat.tlb_refills++;
+	vmstat.cyc_refill += read_cp0_count() - t0;
+	return mask;
 }
 
 #if !defined(LAB) || LAB >= 4
@@ -84,6 +236,23 @@ void _do_tlb_refill(u_long *pentrylo, u_int va, u_int asid) {
  *   The user entry should handle this TLB Mod exception and restore the context.
  */
 void do_tlb_mod(struct Trapframe *tf) {
+	// A writable page loaded read-only by the refill handler: either the zero page, which the
+	// store must not reach, or a clean page with a copy in swap or to be refetched, which the
+	// store makes stale.
+	// This may also come from the kernel writing user memory.
+	Pte *pte;
+	struct Page *pp = page_lookup(cur_pgdir, tf->cp0_badvaddr, &pte);
+	if (pp != NULL && (*pte & PTE_D)) {
+		if (pp->pp_flags & PG_ZERO) {
+			panic_on(zero_page_break(cur_pgdir, curenv->env_asid, tf->cp0_badvaddr));
+		} else {
+			swap_cache_drop(pp);
+			pp->pp_flags &= ~PG_CLEAN;
+			tlb_invalidate(curenv->env_asid, tf->cp0_badvaddr);
+		}
+		return;
+	}
+
 	// Note that we store an original version of tf in a `tmp_tf` for the following reason:
 	// 
 	// 1. The user's handler wants to see the original tf when the exception happens, and
@@ -103,9 +272,6 @@ void do_tlb_mod(struct Trapframe *tf) {
 	struct Trapframe *uxstack = (struct Trapframe *)tf->regs[29];
 	*uxstack = tmp_tf; // Copy the trapframe into UXSTACK
 
-	Pte *pte;
-	page_lookup(cur_pgdir, tf->cp0_badvaddr, &pte);
-
 	if (curenv->env_user_tlb_mod_entry) {
 		tf->regs[4] = tf->regs[29]; // First param is a pointer to the trapframe
 		tf->regs[29] -= sizeof(tf->regs[4]);
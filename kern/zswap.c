@@ -0,0 +1,303 @@
+#include <error.h>
+#include <machine.h>
+#include <pmap.h>
+#include <printk.h>
+#include <sdisk.h>
+#include <string.h>
+#include <zswap.h>
+
+struct zswap_stats zswap_stats;
+
+/* Codec: LZRW1-style LZ77.
+ *
+ * The output is a sequence of groups, each a 16-bit little-endian control word
+ * followed by 16 items, the last group possibly shorter. Bit i of the control
+ * word tells item i is a literal byte (0) or a copy (1). A copy takes two
+ * bytes: a 12-bit offset back into the output and the length minus
+ * LZ_MIN_MATCH in the low 4 bits of the first byte. Matches are only looked up
+ * by a hash of their first LZ_MIN_MATCH bytes, trading ratio for speed.
+ */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 15)
+#define LZ_MAX_OFFSET 4095
+#define LZ_HASH(p) (((((p)[0] << 8) ^ ((p)[1] << 4) ^ (p)[2]) * 40543u >> 4) & ((1 << LZ_HASH_BITS) - 1))
+
+static u_short lz_table[1 << LZ_HASH_BITS]; // Position + 1 of the last string seen per hash.
+
+/* Compress the page at `src` into `dst`, and return the compressed length, or 0 if it
+ * would take more than `max` bytes.
+ */
+static u_int lz_compress(const u_char *src, u_char *dst, u_int max) {
+	const u_char *p = src, *end = src + PAGE_SIZE;
+	u_char *q = dst, *ctrl = NULL;
+	u_int bits = 0, nitem = 16;
+
+	memset(lz_table, 0, sizeof(lz_table));
+	while (p < end) {
+		if (nitem == 16) { // Start a group, with room for 16 copies.
+			if (ctrl != NULL) {
+				ctrl[0] = bits;
+				ctrl[1] = bits >> 8;
+			}
+			if (q + 2 + 16 * 2 > dst + max) { return 0; }
+			ctrl = q;
+			q += 2;
+			bits = nitem = 0;
+		}
+
+		u_int len = 0, off = 0;
+		if (end - p >= LZ_MIN_MATCH) {
+			u_int h = LZ_HASH(p);
+			if (lz_table[h] != 0) {
+				const u_char *m = src + lz_table[h] - 1;
+				off = p - m;
+				if (off <= LZ_MAX_OFFSET && m[0] == p[0] && m[1] == p[1] && m[2] == p[2]) {
+					for (len = LZ_MIN_MATCH;
+					     len < LZ_MAX_MATCH && p + len < end && m[len] == p[len]; len++) {
+					}
+				}
+			}
+			lz_table[h] = p - src + 1;
+		}
+
+		if (len != 0) {
+			bits |= 1u << nitem;
+			*q++ = ((off >> 4) & 0xf0) | (len - LZ_MIN_MATCH);
+			*q++ = off & 0xff;
+			p += len;
+		} else {
+			*q++ = *p++;
+		}
+		nitem++;
+	}
+	ctrl[0] = bits;
+	ctrl[1] = bits >> 8;
+	return q - dst;
+}
+
+// Decompress `len` bytes at `src` into the page at `dst`, and return the decompressed length.
+static u_int lz_decompress(const u_char *src, u_int len, u_char *dst) {
+	const u_char *p = src, *end = src + len;
+	u_char *q = dst, *qend = dst + PAGE_SIZE;
+
+	while (p < end) {
+		u_int bits = p[0] | (p[1] << 8);
+		p += 2;
+		for (u_int i = 0; i < 16 && p < end; i++, bits >>= 1) {
+			if (bits & 1) {
+				u_int off = ((p[0] & 0xf0) << 4) | p[1];
+				u_int n = (p[0] & 0x0f) + LZ_MIN_MATCH;
+				p += 2;
+				panic_on(off == 0 || off > q - dst || n > qend - q);
+				for (; n > 0; n--, q++) { // Byte by byte, as the copy may overlap itself.
+					*q = *(q - off);
+				}
+			} else {
+				panic_on(q == qend);
+				*q++ = *p++;
+			}
+		}
+	}
+	return q - dst;
+}
+
+/* Pool: zbud-style, two objects per page.
+ *
+ * A pool page starts with a 'ZPage' header, followed by its first object, and
+ * ends with its last object. Pages with a free half are kept on
+ * 'zpool_unbuddied' and are filled first-fit; a page is given back as soon as
+ * both halves are free. `zswap_map` maps a swap block to the pool page holding
+ * it, with the half in the low bit, or 0 if the block isn't in the pool.
+ */
+struct ZPage {
+	TAILQ_ENTRY(ZPage) link; // in 'zpool_unbuddied' while one half is free
+	u_short len[2];		 // compressed size of the first and last object, 0 if free
+};
+TAILQ_HEAD(ZPage_tailq, ZPage);
+
+#define ZPAGE_ROOM (PAGE_SIZE - ROUND(sizeof(struct ZPage), sizeof(u_long)))
+
+static struct ZPage_tailq zpool_unbuddied;
+static u_long *zswap_map; // [sd_nblk]
+static u_char zswap_buf[PAGE_SIZE]; // Compression output, copied to the pool if it fits.
+
+static inline u_char *zobj(struct ZPage *zp, u_int half) {
+	return half == 0 ? (u_char *)zp + ROUND(sizeof(struct ZPage), sizeof(u_long))
+			 : (u_char *)zp + PAGE_SIZE - zp->len[1];
+}
+
+void zswap_init(void) {
+	TAILQ_INIT(&zpool_unbuddied);
+	zswap_map = (u_long *)alloc(sd_nblk * sizeof(u_long), sizeof(u_long), 1);
+	memset(&zswap_stats, 0, sizeof(zswap_stats));
+}
+
+// Take a new pool page, or return NULL if the pool is at its limit or memory is short.
+static struct ZPage *zpool_grow(void) {
+	struct Page *pp;
+
+	// page_alloc on an empty free list would reclaim, while we may be reclaiming already.
+	if (zswap_stats.npages >= ZSWAP_MAX_POOL || page_nfree == 0) { return NULL; }
+	panic_on(page_alloc_nozero(&pp));
+	pp->pp_ref = 1; // Keep the page away from swapping.
+	zswap_stats.npages++;
+
+	struct ZPage *zp = (struct ZPage *)page2kva(pp);
+	zp->len[0] = zp->len[1] = 0;
+	return zp;
+}
+
+/* Compress the page `pp` into the pool as the content of swap block `bno`.
+ * Return 0 on success, -E_INVAL if it doesn't compress to ZSWAP_MAX_LEN, or -E_NO_MEM if
+ * the pool has no room for it.
+ */
+int zswap_store(struct Page *pp, u_int bno) {
+	struct ZPage *zp;
+	u_int half = 0;
+
+	panic_on(bno >= sd_nblk || zswap_map[bno] != 0);
+	u_int len = lz_compress((u_char *)page2kva(pp), zswap_buf, ZSWAP_MAX_LEN);
+	if (len == 0) {
+		zswap_stats.rejects++;
+		return -E_INVAL;
+	}
+
+	TAILQ_FOREACH (zp, &zpool_unbuddied, link) {
+		half = zp->len[0] == 0 ? 0 : 1;
+		if (zp->len[!half] + len <= ZPAGE_ROOM) { break; }
+	}
+	if (zp != NULL) {
+		TAILQ_REMOVE(&zpool_unbuddied, zp, link);
+	} else if ((zp = zpool_grow()) != NULL) {
+		half = 0;
+		TAILQ_INSERT_HEAD(&zpool_unbuddied, zp, link);
+	} else {
+		zswap_stats.full++;
+		return -E_NO_MEM;
+	}
+
+	zp->len[half] = len;
+	memcpy(zobj(zp, half), zswap_buf, len);
+	zswap_map[bno] = (u_long)zp | half;
+	zswap_stats.stores++;
+	zswap_stats.nobjs++;
+	zswap_stats.nbytes += len;
+	return 0;
+}
+
+/* Fill `pp` with the content of swap block `bno` from the pool. The pool keeps its copy.
+ * Return 0 on success, or -E_NOT_FOUND if the block isn't in the pool.
+ */
+int zswap_load(struct Page *pp, u_int bno) {
+	panic_on(bno >= sd_nblk);
+	if (zswap_map[bno] == 0) {
+		zswap_stats.misses++;
+		return -E_NOT_FOUND;
+	}
+
+	struct ZPage *zp = (struct ZPage *)(zswap_map[bno] & ~1ul);
+	u_int half = zswap_map[bno] & 1;
+	panic_on(lz_decompress(zobj(zp, half), zp->len[half], (u_char *)page2kva(pp)) != PAGE_SIZE);
+	zswap_stats.hits++;
+	return 0;
+}
+
+// Drop the pooled content of swap block `bno`, if any, as the block is freed.
+void zswap_invalidate(u_int bno) {
+	if (bno >= sd_nblk || zswap_map[bno] == 0) { return; }
+
+	struct ZPage *zp = (struct ZPage *)(zswap_map[bno] & ~1ul);
+	u_int half = zswap_map[bno] & 1;
+	zswap_map[bno] = 0;
+	zswap_stats.nobjs--;
+	zswap_stats.nbytes -= zp->len[half];
+	zp->len[half] = 0;
+
+	if (zp->len[!half] != 0) { // Was full.
+		TAILQ_INSERT_HEAD(&zpool_unbuddied, zp, link);
+		return;
+	}
+	TAILQ_REMOVE(&zpool_unbuddied, zp, link);
+	struct Page *pp = pa2page(PADDR(zp));
+	pp->pp_ref = 0;
+	page_free(pp);
+	zswap_stats.npages--;
+}
+
+void zswap_print_stats(void) {
+	struct zswap_stats *s = &zswap_stats;
+	u_int ratio = s->nbytes ? s->nobjs * PAGE_SIZE * 10 / s->nbytes : 0;
+	u_int hit = s->hits + s->misses ? s->hits * 100 / (s->hits + s->misses) : 0;
+
+	printk("zswap: %d pages in %d pool pages, compression ratio %d.%d\n", s->nobjs, s->npages,
+	       ratio / 10, ratio % 10);
+	printk("zswap: %d stored, %d rejected, %d pool full; swap-in hit rate %d%% (%d/%d)\n",
+	       s->stores, s->rejects, s->full, hit, s->hits, s->hits + s->misses);
+}
+
+/* Overview:
+ *   Self-test of the codec and the pool: pages of various compressibility are
+ *   stored, loaded back and checked, and the compression cycles are reported.
+ *   The pool is empty and the statistics are reset when done.
+ */
+void test_zswap(void) {
+	static const char *const names[] = {"zero", "text", "sparse", "random"};
+	struct Page *src, *dst;
+	u_int y = 2463534242u;
+
+	printk("Testing zswap...\n");
+	panic_on(page_alloc(&src));
+	panic_on(page_alloc(&dst));
+	src->pp_ref = dst->pp_ref = 1;
+	u_char *s = (u_char *)page2kva(src), *d = (u_char *)page2kva(dst);
+
+	for (u_int k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+		for (u_int i = 0; i < PAGE_SIZE; i++) {
+			y ^= y << 13;
+			y ^= y >> 17;
+			y ^= y << 5;
+			switch (k) {
+			case 0: s[i] = 0; break;
+			case 1: s[i] = "the quick brown fox jumps over the lazy dog "[i % 44]; break;
+			case 2: s[i] = (y % 16 == 0) ? y >> 24 : 0; break;
+			default: s[i] = y >> 24; break;
+			}
+		}
+
+		// Store each page twice, to fill both halves of a pool page.
+		u_int nbytes = zswap_stats.nbytes;
+		u_int t0 = read_cp0_count();
+		int r = zswap_store(src, 2 * k);
+		u_int cyc = read_cp0_count() - t0;
+		if (k == 3) {
+			panic_on(r != -E_INVAL); // Random data doesn't compress.
+			printk("%s: rejected, %d cycles\n", names[k], cyc);
+			continue;
+		}
+		panic_on(r != 0);
+		panic_on(zswap_store(src, 2 * k + 1) != 0);
+		printk("%s: %d bytes, %d cycles\n", names[k], zswap_stats.nbytes - nbytes, cyc);
+
+		for (u_int b = 2 * k; b <= 2 * k + 1; b++) {
+			memset(d, 0xa5, PAGE_SIZE);
+			panic_on(zswap_load(dst, b) != 0);
+			for (u_int i = 0; i < PAGE_SIZE; i++) {
+				panic_on(d[i] != s[i]);
+			}
+		}
+	}
+	panic_on(zswap_load(dst, sd_nblk - 1) != -E_NOT_FOUND);
+
+	for (u_int b = 0; b < 6; b++) {
+		zswap_invalidate(b);
+	}
+	panic_on(zswap_stats.nobjs != 0 || zswap_stats.nbytes != 0 || zswap_stats.npages != 0);
+	panic_on(!TAILQ_EMPTY(&zpool_unbuddied));
+	memset(&zswap_stats, 0, sizeof(zswap_stats));
+
+	src->pp_ref = dst->pp_ref = 0;
+	page_free(src);
+	page_free(dst);
+	printk("Test zswap finished!\n");
+}
@@ -1,6 +1,6 @@
 void physical_memory_manage_strong_check(void) {
 	struct Page *pp, *pp0, *pp1, *pp2, *pp3, *pp4;
-	struct Page_list fl;
+	struct Page_free_area fl;
 	int *temp1;
 
 	// should be able to allocate three pages
@@ -18,9 +18,8 @@ void physical_memory_manage_strong_check(void) {
 	assert(pp4 && pp4 != pp3 && pp4 != pp2 && pp4 != pp1 && pp4 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	// now this page_free list must be empty!!!!
-	LIST_INIT(&page_free_list);
+	// now the free area must be empty!!!!
+	page_free_steal(&fl);
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
 
@@ -40,7 +39,7 @@ void physical_memory_manage_strong_check(void) {
 	// pp0 should be zero
 	assert(*temp1 == 0);
 
-	page_free_list = fl;
+	page_free_restore(&fl);
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
@@ -1,6 +1,6 @@
 void page_strong_check(void) {
 	struct Page *pp, *pp0, *pp1, *pp2, *pp3, *pp4;
-	struct Page_list fl;
+	struct Page_free_area fl;
 
 	// should be able to allocate a page for directory
 	assert(page_alloc(&pp) == 0);
@@ -21,9 +21,8 @@ void page_strong_check(void) {
 	assert(pp4 && pp4 != pp3 && pp4 != pp2 && pp4 != pp1 && pp4 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	// now this page_free list must be empty!!!!
-	LIST_INIT(&page_free_list);
+	// now the free area must be empty!!!!
+	page_free_steal(&fl);
 
 	// there is no free memory, so we can't allocate a page table
 	assert(page_insert(boot_pgdir, 0, pp1, 0x0, 0) < 0);
@@ -119,7 +118,7 @@ void page_strong_check(void) {
 	pp1->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	page_free_restore(&fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -5,6 +5,7 @@ extern void _do_tlb_refill(u_long *pentrylo, u_int va, u_int asid);
 
 void tlb_refill_check(void) {
 	struct Page *pp, *pp0, *pp1, *pp2, *pp3, *pp4;
+	struct Page_free_area fl;
 
 	// should be able to allocate a page for directory
 	assert(page_alloc(&pp) == 0);
@@ -20,8 +21,8 @@ void tlb_refill_check(void) {
 	assert(page_alloc(&pp4) == 0);
 
 	// temporarily steal the rest of the free pages
-	// now this page_free list must be empty!!!!
-	LIST_INIT(&page_free_list);
+	// now the free area must be empty!!!!
+	page_free_steal(&fl);
 
 	// free pp0 and try again: pp0 should be used for page table
 	page_free(pp0);
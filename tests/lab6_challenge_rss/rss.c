@@ -0,0 +1,52 @@
+#include <lib.h>
+
+// A job under a hard resident limit streams through more pages than the machine
+// has, while its parent keeps a small working set that must stay resident.
+#define LIMIT 1024
+#define NSTREAM 16384
+#define NKEEP 64
+#define STREAM_VA 0x44000000
+#define KEEP_VA 0x40000000
+
+static void job(void) {
+	panic_on(syscall_set_rss_limit(0, LIMIT, 1));
+	debugf("[rss test] job writing to memory...\n");
+	for (int i = 0; i < NSTREAM; i++) {
+		*(int *)(STREAM_VA + (i << 12)) = i;
+	}
+	for (int i = 0; i < NSTREAM; i++) {
+		int v = *(int *)(STREAM_VA + (i << 12));
+		if (v != i) {
+			debugf("failed on page %d: %d expected but %d found\n", i, i, v);
+			panic_on(v != i);
+		}
+	}
+	debugf("[rss test] job done, %d pages resident\n", env->env_rss);
+	// Page tables count too, and the hard limit is enforced after every fault.
+	panic_on(env->env_rss > LIMIT);
+}
+
+int main() {
+	int child = fork();
+	panic_on(child < 0);
+	if (child == 0) {
+		job();
+		return 0;
+	}
+
+	// Touched after the fork, so that the job shares none of these pages.
+	for (int i = 0; i < NKEEP; i++) {
+		*(int *)(KEEP_VA + (i << 12)) = i;
+	}
+	wait(child);
+	for (int i = 0; i < NKEEP; i++) {
+		u_int va = KEEP_VA + (i << 12);
+		if (!(vpt[VPN(va)] & PTE_V)) {
+			debugf("page %d of the working set was swapped out, PTE = %x\n", i, vpt[VPN(va)]);
+			panic_on(1);
+		}
+		panic_on(*(int *)va != i);
+	}
+	debugf("[rss test] rss test ok\n");
+	return 0;
+}
@@ -71,6 +71,9 @@ int syscall_ipc_recv(void *dstva);
 int syscall_cgetc(void);
 int syscall_write_dev(void *va, u_int dev, u_int len);
 int syscall_read_dev(void *va, u_int dev, u_int len);
+int syscall_vmstat(struct vmstat *buf);
+int syscall_set_rss_limit(u_int envid, u_int npages, int hard);
+int syscall_pageref(void *va);
 
 // ipc.c
 void ipc_send(u_int whom, u_int val, const void *srcva, u_int perm);
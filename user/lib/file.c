@@ -152,7 +152,7 @@ int read_map(int fdnum, u_int offset, void **blk) {
 		return -E_NO_DISK;
 	}
 
-	if (!(vpd[PDX(va)] & PTE_V) || !(vpt[VPN(va)] & (PTE_V | PTE_SWAPPED))) {
+	if (!(vpd[PDX(va)] & (PTE_V | PTE_SWAPPED)) || !(vpt[VPN(va)] & (PTE_V | PTE_SWAPPED))) {
 		return -E_NO_DISK;
 	}
 
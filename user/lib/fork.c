@@ -140,7 +140,7 @@ int fork(void) {
 
 	// Parent continue here:
 	for (u_int va = UTEMP; va < USTACKTOP; va += PAGE_SIZE) {
-		if (vpd[PDX(va)] & PTE_V)
+		if (vpd[PDX(va)] & (PTE_V | PTE_SWAPPED)) // A swapped page table is faulted in by vpt.
 			duppage(child, VPN(va));
 	}
 	//debugf("duppages end\n");
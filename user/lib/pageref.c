@@ -15,16 +15,17 @@ int pageref(void *v) {
 	u_int pte;
 
 	/* Step 1: Check the page directory. */
+	// A swapped-out page table only maps swapped-out pages, counted by the kernel.
 	if (!(vpd[PDX(v)] & PTE_V)) {
-		return 0;
+		return (vpd[PDX(v)] & PTE_SWAPPED) ? syscall_pageref(v) : 0;
 	}
 
 	/* Step 2: Check the page table. */
-	//int tmp = *((int *)v); // Trigger swapping back
 	pte = vpt[VPN(v)];
-	syscall_mem_map(0, v, 0, v, PTE_FLAGS(pte)); // Trigger swapping back
-	pte = vpt[VPN(v)];
-	if (!(pte & PTE_V)) { return 0; }
+	if (!(pte & PTE_V)) {
+		// The mappings of a swapped-out page are counted without swapping it in.
+		return (pte & PTE_SWAPPED) ? syscall_pageref(v) : 0;
+	}
 	/* Step 3: Return the result. */
 	return pages[PPN(pte)].pp_ref;
 }
@@ -187,7 +187,7 @@ int spawn(char *prog, char **argv) {
 
 	// Pages with 'PTE_LIBRARY' set are shared between the parent and the child.
 	for (u_int pdeno = 0; pdeno <= PDX(USTACKTOP); pdeno++) {
-		if (!(vpd[pdeno] & PTE_V)) {
+		if (!(vpd[pdeno] & (PTE_V | PTE_SWAPPED))) {
 			continue;
 		}
 		for (u_int pteno = 0; pteno <= PTX(~0); pteno++) {
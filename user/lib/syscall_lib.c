@@ -74,3 +74,15 @@ int syscall_read_dev(void *va, u_int dev, u_int size) {
 	/* Exercise 5.2: Your code here. (2/2) */
 	return msyscall(SYS_read_dev, va, dev, size);
 }
+
+int syscall_vmstat(struct vmstat *buf) {
+	return msyscall(SYS_vmstat, buf);
+}
+
+int syscall_set_rss_limit(u_int envid, u_int npages, int hard) {
+	return msyscall(SYS_set_rss_limit, envid, npages, hard);
+}
+
+int syscall_pageref(void *va) {
+	return msyscall(SYS_pageref, va);
+}
@@ -0,0 +1,115 @@
+#include <lib.h>
+
+/*
+ * vmstat [interval [count]]
+ *
+ * Without arguments, print the virtual memory statistics since boot. Otherwise
+ * print a line of the events in each 'interval' timer ticks, 'count' times
+ * (forever if not given). Cycles are CP0 Count cycles per event.
+ */
+
+static struct vmstat prev, cur;
+
+static u_int parse(const char *s) {
+	u_int n = 0;
+	for (; *s >= '0' && *s <= '9'; s++) {
+		n = n * 10 + (*s - '0');
+	}
+	if (*s != '\0') {
+		user_panic("vmstat: bad number: %s", s);
+	}
+	return n;
+}
+
+static u_int per(u_int cyc, u_int n) {
+	return n ? cyc / n : 0;
+}
+
+static void sample(struct vmstat *st) {
+	int r = syscall_vmstat(st);
+	if (r < 0) {
+		user_panic("syscall_vmstat: %d", r);
+	}
+}
+
+static void print_totals(struct vmstat *s) {
+	printf("%8u free pages of %u\n", s->free_pages, s->total_pages);
+	printf("%8s free blocks by order:", "");
+	for (int i = 0; i < PAGE_NORDER; i++) {
+		printf(" %u", s->free_blocks[i]);
+	}
+	printf("\n");
+	printf("%8u free pages zeroed ahead of time\n", s->zeroed_pages);
+	printf("%8u pages held by kernel object caches\n", s->kmem_pages);
+	printf("%8u swap blocks used of %u\n", s->swap_used, s->swap_total);
+	printf("%8u timer ticks\n", s->ticks);
+	printf("%8u swap-outs, %u cycles each\n", s->swapouts, per(s->cyc_swapout, s->swapouts));
+	printf("%8u swap-ins, %u cycles each\n", s->swapins, per(s->cyc_swapin, s->swapins));
+	printf("%8u pages read ahead\n", s->readaheads);
+	printf("%8u zero pages deduplicated\n", s->zero_dedups);
+	printf("%8u direct reclaims, %u cycles each\n", s->direct_reclaims,
+	       per(s->cyc_reclaim, s->direct_reclaims));
+	printf("%8u pages scanned for victims\n", s->scanned);
+	printf("%8u TLB refills, %u cycles each\n", s->tlb_refills, per(s->cyc_refill, s->tlb_refills));
+	printf("%8u passive allocations, %u cycles each\n", s->passive_allocs,
+	       per(s->cyc_passive, s->passive_allocs));
+	printf("%8u first reads mapped to the zero page\n", s->zero_maps);
+	printf("%8u faults blocked on a swap-in read\n", s->swapin_waits);
+	printf("%8u page tables swapped out, %u in\n", s->pt_swapouts, s->pt_swapins);
+	printf("%8u pages swapped out over resident limits\n", s->rss_evictions);
+	printf("%8u major faults\n", s->majflts);
+	printf("%8u swapped-out pages shared without a swap-in\n", s->swap_shares);
+	printf("%8u clean refetchable pages dropped\n", s->refetch_drops);
+	printf("%8u pages pre-zeroed, %u allocations served zeroed\n", s->prezeroed,
+	       s->prezero_hits);
+	printf("%8u large-page blocks allocated, %u large TLB refills\n", s->large_allocs,
+	       s->large_refills);
+	printf("%8u envs deactivated for thrashing, %u reactivated\n", s->deactivations,
+	       s->reactivations);
+	printf("%8u pages in zswap, %u bytes in %u pool pages\n", s->zswap_objs, s->zswap_bytes,
+	       s->zswap_pages);
+	printf("%8u zswap stores, %u rejected, %u pool full\n", s->zswap_stores, s->zswap_rejects,
+	       s->zswap_full);
+	printf("%8u zswap hits, %u misses\n", s->zswap_hits, s->zswap_misses);
+}
+
+static void print_header(void) {
+	printf("   free  swap   out    in    ra  zdup  recl   scan  refill  pasv  zhit zmiss"
+	       " cyc/out cyc/in cyc/ref\n");
+}
+
+#define D(f) (cur.f - prev.f)
+
+static void print_delta(void) {
+	printf("%7u %5u %5u %5u %5u %5u %5u %6u %7u %5u %5u %5u %7u %6u %7u\n", cur.free_pages,
+	       cur.swap_used, D(swapouts), D(swapins), D(readaheads), D(zero_dedups),
+	       D(direct_reclaims), D(scanned), D(tlb_refills), D(passive_allocs), D(zswap_hits),
+	       D(zswap_misses), per(D(cyc_swapout), D(swapouts)), per(D(cyc_swapin), D(swapins)),
+	       per(D(cyc_refill), D(tlb_refills)));
+}
+
+int main(int argc, char **argv) {
+	if (argc == 1) {
+		sample(&cur);
+		print_totals(&cur);
+		return 0;
+	}
+
+	u_int interval = parse(argv[1]);
+	u_int count = argc > 2 ? parse(argv[2]) : 0;
+	if (interval == 0) {
+		user_panic("vmstat: interval must be positive");
+	}
+
+	print_header();
+	sample(&prev);
+	for (u_int i = 0; count == 0 || i < count; i++) {
+		do {
+			syscall_yield();
+			sample(&cur);
+		} while (cur.ticks - prev.ticks < interval);
+		print_delta();
+		prev = cur;
+	}
+	return 0;
+}